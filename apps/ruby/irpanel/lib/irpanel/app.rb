@@ -3,6 +3,8 @@ require 'thread'
 
 module IRPanel
   class App
+    MAX_BATCH = 64
+
     def self.field(name, x, y)
       @fields ||= Hash.new
       raise(ArgumentError, "Field #{name} already defined")\
@@ -150,7 +152,12 @@ module IRPanel
             end
           when @rpipe
             IO.select([], [@socket])
-            line = @rpipe.readline
+            lines = [@rpipe.readline]
+            while lines.length < MAX_BATCH && IO.select([@rpipe], nil, nil, 0)
+              lines.push(@rpipe.readline)
+            end
+            line = lines.join
+            line = "b:#{lines.length}\n" + line if lines.length > 1
             log :debug, "PKT OUT: #{line.chop}"
             @socket.write(line)
             @socket.flush
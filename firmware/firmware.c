@@ -4,6 +4,9 @@
  * Tie together all parts and provide a simple packet-based CLI
  * via UART.
  *
+ * IR packets carry two stamps of a free-running clock (256 us ticks, see
+ * clk_now()): when the command was decoded and when it was sent.
+ *
  * @author Piotr S. Staszewski
  */
 
@@ -23,9 +26,41 @@
 
 #define PWM_INITIAL 0x80  //!< Initial value for PWM
 
+// Internal variables
+
+static volatile uint16_t clkOverflows; //!< Timer1 overflows (every 2048 us)
+
+// Public routines
+
+/** Read the stamping clock, see RC5_CLOCK and CLI_CLOCK.
+ * Timer1 overflows make the upper bits and its count the lower three,
+ * so the overflow interrupt is only needed every eighth tick.
+ * Call with interrupts disabled.
+ *
+ * @return The clock, in 256 us ticks
+ */
+uint16_t clk_now() {
+  uint8_t count = TCNT1L;
+  uint16_t overflows = clkOverflows;
+
+  if ((TIFR & _BV(TOV1)) && (count < 0x80)) overflows++; // not handled yet
+  return (overflows << 3) | (count >> 5);
+}
+
+// Interrupt handlers
+
+/** Timer1 overflow interrupt handler.
+ * Advances the stamping clock.
+ */
+ISR(TIMER1_OVF_vect) {
+  clkOverflows++;
+}
+
 // Main routine
 
 int main() {
+  uint16_t now;
+
   DDRA = 0xff;
   DDRB = 0xff;
   DDRD = 0x72;
@@ -33,10 +68,11 @@ int main() {
   PORTA = 0x00;
   PORTB = 0x00;
 
-  // Fast 8-bit PWM on OC1B (PD4), 1/8 prescaler
+  // Fast 8-bit PWM on OC1B (PD4), 1/64 prescaler (~490 Hz)
   TCCR1A = _BV(COM1B1) | _BV(WGM10);
-  TCCR1B = _BV(WGM12) | _BV(CS11);
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
   OCR1B = PWM_INITIAL;
+  TIMSK |= _BV(TOIE1);
 
   uartcli_init();
   rc5_init();
@@ -45,18 +81,24 @@ int main() {
   sei();
 
   while (true) {
-    sleep_mode(); // enter idle mode
-    if (rc5HasCmd) {
+    if (!rc5HasCmd && !cliHasCmd) sleep_mode(); // enter idle mode
+    if (rc5HasCmd) { // the decoder holds off until rc5_next()
       cli();
-      uart_send_byte(0x03);         // packet length
+      now = clk_now();
+      sei();
+      uart_send_byte(0x07);         // packet length
       uart_send_byte((uint8_t)'i'); // input code
       uart_send_byte((uint8_t)RC5_GetAddressBits(rc5Cmd));
       uart_send_byte((uint8_t)RC5_GetCommandBits(rc5Cmd));
+      uart_send_byte((uint8_t)rc5Stamp);        // decoded at (LSB first)
+      uart_send_byte((uint8_t)(rc5Stamp >> 8));
+      uart_send_byte((uint8_t)now);             // sent at
+      uart_send_byte((uint8_t)(now >> 8));
+      cli();
       rc5_next();
       sei();
     }
-    if (cliHasCmd) {
-      cli();
+    if (cliHasCmd) { // the slot is kept until uartcli_next()
       switch (cliBuffer[0]) {
         case 'c': // clear lcd
           lcd_send_byte(LCD_CMD_CLEAR, false, true);
@@ -76,16 +118,31 @@ int main() {
         case 'r': // send raw byte to the lcd
           lcd_send_byte((uint8_t)cliBuffer[1], (bool)cliBuffer[2], (bool)cliBuffer[3]);
           break;
+        case 'w': // window query, the reply doubles as the ack
+          uartcli_confirm();
+          uart_send_byte(0x02);         // packet length
+          uart_send_byte((uint8_t)'w'); // window code
+          uart_send_byte(CLI_SLOTS);
+          break;
+        case 'b': // baud rate switch, acked at the old rate
+          uart_send_byte(0x01);         // packet length
+          uart_send_byte((uint8_t)'d'); // done code
+          uartcli_baud((uint8_t)cliBuffer[1], (bool)cliBuffer[2]);
+          break;
         default: // output received data, for testing
           #ifdef DEBUG
             uart_write_str((char *)cliBuffer);
           #endif
           break;
       }
-      uart_send_byte(0x01);         // packet length
-      uart_send_byte((uint8_t)'d'); // done code
+      if ((cliBuffer[0] != 'w') && (cliBuffer[0] != 'b')) {
+        uart_send_byte(0x01);         // packet length
+        uart_send_byte((uint8_t)'d'); // done code
+      }
+      cli();
       uartcli_next();
       sei();
     }
+    uartcli_expire();
   }
 }
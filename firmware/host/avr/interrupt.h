@@ -0,0 +1,16 @@
+/** @file
+ * Host stand-in for avr/interrupt.h
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef EMU_AVR_INTERRUPT
+#define EMU_AVR_INTERRUPT 1
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void)
+#define cli()            emu_cli()
+#define sei()            emu_sei()
+
+#endif
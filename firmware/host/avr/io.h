@@ -0,0 +1,17 @@
+/** @file
+ * Host stand-in for avr/io.h
+ *
+ * The firmware main() is renamed, so the emulator can provide its own
+ * and run the firmware once the hardware is up.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef EMU_AVR_IO
+#define EMU_AVR_IO 1
+
+#include "../emu.h"
+
+#define main firmware_main
+
+#endif
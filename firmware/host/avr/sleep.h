@@ -0,0 +1,14 @@
+/** @file
+ * Host stand-in for avr/sleep.h
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef EMU_AVR_SLEEP
+#define EMU_AVR_SLEEP 1
+
+#include <avr/io.h>
+
+#define sleep_mode() emu_sleep()
+
+#endif
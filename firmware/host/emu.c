@@ -0,0 +1,850 @@
+/** @file
+ * IRPanel firmware host emulator
+ *
+ * Runs the real firmware on the host, with the panel hardware emulated
+ * well enough to talk to irpaneld:
+ *
+ *  - the UART is a pseudo-terminal, paced at the baud rate the firmware
+ *    configures, with the double-buffered transmitter and the receive
+ *    buffer of the real thing (bytes that do not fit are overruns); TXC
+ *    is cleared by writing a one to it, and a byte the baud rate changed
+ *    under before it was out is garbled, as is every byte while the host
+ *    has the pseudo-terminal at another rate
+ *  - the LCD is an in-memory HD44780 (see hd44780.c)
+ *  - RC5 frames written to a FIFO are played into INT0 edge by edge, in
+ *    real time, so the real decoder is exercised
+ *  - Timer1 overflows and its count drive the firmware clock, and the
+ *    overflows wake it from sleep
+ *
+ * The firmware runs on the main thread and interrupts are only delivered
+ * when the firmware could take them: with the interrupt flag set, at
+ * sei(), while sleeping, and during delays and busy waits. That keeps the
+ * firmware single-threaded, like on the chip. Delays take real time.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <asm/termbits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+// Configurable defines
+
+#define EMU_RXBUF     3       //!< Received bytes held (2 in UDR, 1 in the shift register)
+#define EMU_TXBUF     2       //!< Bytes being sent (1 in UDR, 1 in the shift register)
+#define EMU_RC5HALF   889     //!< RC5 half bit in us
+#define EMU_RC5FRAME  113778  //!< RC5 frame repeat period in us
+#define EMU_EDGES     32      //!< RC5 edges queued while the host lags
+#define EMU_BAUDSLACK 5       //!< Baud rate mismatch the UART copes with, in percent
+
+// Internal defines
+
+#define NS  1000000000LL      //!< Nanoseconds in a second
+
+// Internal variables
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; //!< Guards the hardware state
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;   //!< Something for the CPU
+static pthread_cond_t txWake = PTHREAD_COND_INITIALIZER; //!< Transmitter progress
+
+static int fdPty;             //!< Pseudo-terminal master
+static bool verbose;          //!< Dump the display on changes
+
+static bool iflag;            //!< Global interrupt flag
+static bool inRx;             //!< Running the receive interrupt
+static long long cpuClock;    //!< Where the last delay ended (ns)
+
+static uint8_t rxBuf[EMU_RXBUF]; //!< Receive buffer
+static int rxHead;            //!< Oldest received byte
+static int rxCount;           //!< Received bytes held
+static uint8_t rxLatch;       //!< Byte read by the receive interrupt
+
+static uint8_t txBuf[EMU_TXBUF]; //!< Transmit buffer (head is shifting out)
+static long txRate[EMU_TXBUF]; //!< Baud rate divisor each byte was loaded at
+static int txHead;            //!< Byte being shifted out
+static int txCount;           //!< Bytes in the transmitter
+static uint8_t txLatch;       //!< Last write to UDR
+static bool txPending;        //!< txLatch waits to be committed
+
+static uint8_t ucsra;         //!< UCSRA as the hardware has it
+static uint8_t ucsraLatch;    //!< UCSRA as the firmware accessed it
+static bool ucsraPending;     //!< ucsraLatch waits to be committed
+
+static struct {
+  bool high;                  //!< Pin level after the edge
+  long long at;               //!< When it happened (ns)
+} edges[EMU_EDGES];           //!< INT0 edges not yet delivered
+static int edgeHead;          //!< Oldest pending edge
+static int edgeCount;         //!< Pending edges
+static long long int0Last;    //!< When the last serviced edge happened (ns)
+static long long t1Start;     //!< When Timer1 started counting (ns), 0 if stopped
+static long long t1Done;      //!< Timer1 overflows delivered
+
+static unsigned long overruns; //!< Received bytes lost
+static unsigned long garbled; //!< Bytes garbled by a baud rate change or mismatch
+
+// Public variables
+
+volatile uint8_t DDRA, DDRB, DDRD;
+volatile uint8_t PORTA, PORTB, PORTD, PIND;
+volatile uint8_t MCUCR, GIMSK, TIMSK;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0;
+volatile uint8_t TCCR1A, TCCR1B, OCR1B;
+volatile uint8_t UCSRB, UCSRC, UBRRH, UBRRL;
+
+// Firmware entry point and interrupt handlers
+
+int firmware_main(void);
+
+void INT0_vect(void) __attribute__((weak));
+void TIMER1_OVF_vect(void) __attribute__((weak));
+void USART_RX_vect(void) __attribute__((weak));
+void USART_UDRE_vect(void) __attribute__((weak));
+
+// Internal routines
+
+/** Monotonic time in nanoseconds
+ *
+ * @return The time
+ * @private
+ */
+static long long now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS + ts.tv_nsec;
+}
+
+/** Sleep until a point in time
+ *
+ * @param t The time (ns)
+ * @private
+ */
+static void sleep_until(long long t) {
+  struct timespec ts;
+
+  ts.tv_sec = t / NS;
+  ts.tv_nsec = t % NS;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+/** Baud rate divisor (CPU clocks per bit) as configured
+ *
+ * @return The divisor
+ * @private
+ */
+static long rate() {
+  return (((UBRRH << 8) | UBRRL) + 1) * ((ucsra & _BV(U2X)) ? 8 : 16);
+}
+
+/** Check whether the host is at the configured baud rate
+ * Going by the rate it set on the pseudo-terminal, within EMU_BAUDSLACK.
+ *
+ * @return True if it is
+ * @private
+ */
+static bool rate_matches() {
+  struct termios2 tio;
+
+  if (ioctl(fdPty, TCGETS2, &tio) != 0) return true;
+  return llabs((long long)tio.c_ospeed * rate() - F_CPU) * 100 <= F_CPU * EMU_BAUDSLACK;
+}
+
+/** Time on the wire of one UART frame, at the configured baud rate
+ *
+ * @return The time (ns)
+ * @private
+ */
+static long long byte_time() {
+  long long bits;
+
+  bits = (UCSRC & _BV(USBS)) ? 11 : 10;
+  return bits * rate() * NS / F_CPU;
+}
+
+/** Prescaler selected by clock select bits
+ *
+ * @param cs The CS bits
+ * @return The prescaler, 0 if the timer is stopped
+ * @private
+ */
+static long prescaler(uint8_t cs) {
+  static const long scale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+  return scale[cs & 0x07];
+}
+
+/** Timer1 counts since it started
+ *
+ * @return The counts, 0 if it is stopped
+ * @private
+ */
+static long long t1_counts() {
+  long scale;
+
+  if ((t1Start == 0) || ((scale = prescaler(TCCR1B)) == 0))
+    return 0;
+  return (now_ns() - t1Start) / (scale * NS / F_CPU);
+}
+
+/** When the next Timer1 overflow interrupt is due
+ *
+ * @return The time (ns), 0 if none is coming
+ * @private
+ */
+static long long t1_next() {
+  long scale;
+
+  if (!(TIMSK & _BV(TOIE1)) || (t1Start == 0) || ((scale = prescaler(TCCR1B)) == 0))
+    return 0;
+  return t1Start + (t1Done + 1) * (256LL * scale * NS / F_CPU);
+}
+
+/** Hand the last UDR write to the transmitter
+ * Waits while the transmitter is full, as the firmware would.
+ *
+ * @private
+ */
+static void tx_commit() {
+  if (!txPending) return;
+  txPending = false;
+
+  pthread_mutex_lock(&lock);
+  while (txCount >= EMU_TXBUF)
+    pthread_cond_wait(&txWake, &lock);
+  txBuf[(txHead + txCount) % EMU_TXBUF] = txLatch;
+  txRate[(txHead + txCount) % EMU_TXBUF] = rate();
+  if (++txCount >= EMU_TXBUF) ucsra &= ~_BV(UDRE);
+  pthread_cond_broadcast(&txWake);
+  pthread_mutex_unlock(&lock);
+}
+
+/** Apply the last UCSRA write
+ * Only U2X and MPCM can be written, and a one written to TXC clears it.
+ * The flags are handed out with TXC clear (see emu_bit()), so a set TXC
+ * can only be a write.
+ *
+ * @private
+ */
+static void ucsra_commit() {
+  const uint8_t writable = _BV(U2X) | _BV(MPCM);
+
+  if (!ucsraPending) return;
+  ucsraPending = false;
+
+  pthread_mutex_lock(&lock);
+  ucsra = (ucsra & ~writable) | (ucsraLatch & writable);
+  if (ucsraLatch & _BV(TXC)) ucsra &= ~_BV(TXC);
+  pthread_mutex_unlock(&lock);
+}
+
+/** Apply whatever the firmware wrote to the registers with side effects
+ * Each access to one commits the other first, so there is only ever one
+ * write pending and the order is kept.
+ *
+ * @private
+ */
+static void commit() {
+  tx_commit();
+  ucsra_commit();
+}
+
+/** Deliver pending interrupts
+ * Only with the interrupt flag set, and only the enabled ones.
+ *
+ * @return True if any interrupt other than the timer was delivered
+ * @private
+ */
+static bool service() {
+  long long now, due, tick, delta;
+  bool any, run;
+  long scale;
+
+  any = false;
+  while (iflag) {
+    now = now_ns();
+
+    // Timer1 overflows (8-bit fast PWM, TOP is 0xff)
+    if ((scale = prescaler(TCCR1B)) == 0)
+      t1Start = 0;
+    else if (t1Start == 0) {
+      t1Start = now;
+      t1Done = 0;
+    } else {
+      due = (now - t1Start) / (256LL * scale * NS / F_CPU);
+      if ((TIMSK & _BV(TOIE1)) && TIMER1_OVF_vect)
+        for (; t1Done < due; t1Done++) TIMER1_OVF_vect();
+      t1Done = due;
+    }
+
+    pthread_mutex_lock(&lock);
+
+    // INT0, replayed edge by edge with Timer0 counting between them, so
+    // the host waking up late does not skew what the decoder sees
+    if ((edgeCount > 0) && (GIMSK & _BV(INT0)) && INT0_vect) {
+      if (edges[edgeHead].high) PIND |= _BV(PD2);
+      else PIND &= ~_BV(PD2);
+      tick = prescaler(TCCR0B) * NS / F_CPU;
+      delta = edges[edgeHead].at - int0Last;
+      TCNT0 = (tick && (delta / tick < 0xff)) ? delta / tick : 0xff;
+      int0Last = edges[edgeHead].at;
+      edgeHead = (edgeHead + 1) % EMU_EDGES;
+      edgeCount--;
+      pthread_mutex_unlock(&lock);
+      INT0_vect();
+      any = true;
+      continue;
+    }
+
+    // receive complete
+    if ((rxCount > 0) && (UCSRB & _BV(RXCIE)) && USART_RX_vect) {
+      rxLatch = rxBuf[rxHead];
+      rxHead = (rxHead + 1) % EMU_RXBUF;
+      if (--rxCount == 0) ucsra &= ~_BV(RXC);
+      pthread_mutex_unlock(&lock);
+      inRx = true;
+      USART_RX_vect();
+      inRx = false;
+      any = true;
+      continue;
+    }
+
+    // data register empty
+    run = (txCount < EMU_TXBUF) && (UCSRB & _BV(UDRIE)) && USART_UDRE_vect;
+    pthread_mutex_unlock(&lock);
+    if (!run) break;
+
+    USART_UDRE_vect();
+    commit();
+    any = true;
+  }
+
+  return any;
+}
+
+/** Check whether an interrupt is waiting to be delivered
+ * Timer1 does not count, its overflows are caught up on lazily.
+ * Has to be called with the lock held.
+ *
+ * @return True if one is
+ * @private
+ */
+static bool pending() {
+  return ((edgeCount > 0) && (GIMSK & _BV(INT0))) ||
+    ((rxCount > 0) && (UCSRB & _BV(RXCIE))) ||
+    ((txCount < EMU_TXBUF) && (UCSRB & _BV(UDRIE)));
+}
+
+/** Wait for something for the CPU, but not past a point in time
+ * Has to be called with the lock held.
+ *
+ * @param t The time (ns)
+ * @return False if the time has come
+ * @private
+ */
+static bool wait_until(long long t) {
+  struct timespec ts;
+  long long wait;
+
+  if ((wait = t - now_ns()) <= 0) return false;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_nsec += wait % NS;
+  ts.tv_sec += wait / NS + ts.tv_nsec / NS;
+  ts.tv_nsec %= NS;
+  return pthread_cond_timedwait(&wake, &lock, &ts) != ETIMEDOUT;
+}
+
+/** Receiver thread
+ * Reads what the host sends and feeds it to the receive buffer one byte
+ * at a time, at the configured baud rate.
+ *
+ * @param arg Not used
+ * @return Never
+ * @private
+ */
+static void *rx_thread(void *arg) {
+  unsigned char buf[256];
+  long long at;
+  int count, i;
+
+  at = 0;
+  while (true) {
+    if ((count = read(fdPty, buf, sizeof(buf))) <= 0) {
+      if ((count < 0) && (errno != EINTR) && (errno != EAGAIN) && (errno != EIO)) {
+        perror("PTY read");
+        exit(1);
+      }
+      usleep(10000);
+      continue;
+    }
+
+    for (i = 0; i < count; i++) {
+      at = (at > now_ns() ? at : now_ns()) + byte_time();
+      sleep_until(at);
+
+      pthread_mutex_lock(&lock);
+      if ((UCSRB & _BV(RXEN)) && !rate_matches()) {
+        garbled++;
+        fprintf(stderr, "UART: host at another baud rate, byte 0x%02x garbled\n", buf[i]);
+        buf[i] = ~buf[i];
+      }
+      if (!(UCSRB & _BV(RXEN)))
+        ;
+      else if (rxCount >= EMU_RXBUF) {
+        overruns++;
+        ucsra |= _BV(DOR);
+        fprintf(stderr, "UART: overrun, byte 0x%02x lost\n", buf[i]);
+      } else {
+        rxBuf[(rxHead + rxCount) % EMU_RXBUF] = buf[i];
+        rxCount++;
+        ucsra |= _BV(RXC);
+        pthread_cond_broadcast(&wake);
+      }
+      pthread_mutex_unlock(&lock);
+    }
+  }
+
+  return NULL;
+}
+
+/** Transmitter thread
+ * Shifts bytes out to the host at the configured baud rate.
+ *
+ * @param arg Not used
+ * @return Never
+ * @private
+ */
+static void *tx_thread(void *arg) {
+  long long at;
+  uint8_t data;
+
+  at = 0;
+  while (true) {
+    pthread_mutex_lock(&lock);
+    while (txCount == 0)
+      pthread_cond_wait(&txWake, &lock);
+    data = txBuf[txHead];
+    pthread_mutex_unlock(&lock);
+
+    at = (at > now_ns() ? at : now_ns()) + byte_time();
+    sleep_until(at);
+
+    // the host still listens at the rate the byte was meant for
+    pthread_mutex_lock(&lock);
+    if (txRate[txHead] != rate()) {
+      garbled++;
+      fprintf(stderr, "UART: baud rate changed under byte 0x%02x, garbled\n", data);
+      data = ~data;
+    } else if (!rate_matches()) {
+      garbled++;
+      fprintf(stderr, "UART: host at another baud rate, byte 0x%02x garbled\n", data);
+      data = ~data;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (write(fdPty, &data, 1) != 1)
+      perror("PTY write");
+
+    pthread_mutex_lock(&lock);
+    txHead = (txHead + 1) % EMU_TXBUF;
+    if (--txCount == 0) ucsra |= _BV(TXC);
+    ucsra |= _BV(UDRE);
+    pthread_cond_broadcast(&txWake);
+    pthread_cond_broadcast(&wake);
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+/** Set the RC5 pin level
+ * Every change raises INT0 (the firmware triggers on any change). While
+ * INT0 is masked only the flag is kept, as on the chip, so just the
+ * latest edge stays pending.
+ *
+ * @param high The new level
+ * @param at When the edge is due (ns), so thread wake-up jitter stays out
+ * @private
+ */
+static void rc5_pin(bool high, long long at) {
+  int slot;
+
+  pthread_mutex_lock(&lock);
+  if (!(GIMSK & _BV(INT0))) {
+    if (high) PIND |= _BV(PD2);
+    else PIND &= ~_BV(PD2);
+    edgeCount = 0;
+  }
+  if (edgeCount == EMU_EDGES) {
+    edgeHead = (edgeHead + 1) % EMU_EDGES;
+    edgeCount--;
+  }
+  slot = (edgeHead + edgeCount++) % EMU_EDGES;
+  edges[slot].high = high;
+  edges[slot].at = at;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+/** Play one RC5 frame on the pin
+ * As seen after the receiver module: idle high, a one is high then low,
+ * a zero low then high.
+ *
+ * @param bits The 14 frame bits
+ * @param start When the frame is due (ns)
+ * @private
+ */
+static void rc5_frame(uint16_t bits, long long start) {
+  long long at;
+  bool level, next;
+  int half;
+
+  level = true;
+  for (half = 0; half <= 28; half++) {
+    if (half == 28) next = true;
+    else next = ((bits >> (13 - half / 2)) & 1) ^ (half & 1);
+    if (next != level) {
+      at = start + half * EMU_RC5HALF * 1000LL;
+      sleep_until(at);
+      rc5_pin(next, at);
+      level = next;
+    }
+  }
+}
+
+/** RC5 injection thread
+ * Reads 'ADDR CMD [REPEATS]' lines from the FIFO and plays each as a key
+ * press, repeating the frame as a held key would.
+ *
+ * @param arg Path to the FIFO
+ * @return Never
+ * @private
+ */
+static void *rc5_thread(void *arg) {
+  const char *path = arg;
+  unsigned int addr, cmd, repeats;
+  char line[64];
+  long long next;
+  bool toggle;
+  FILE *f;
+
+  toggle = false;
+  next = 0;
+  while (true) {
+    if ((f = fopen(path, "r")) == NULL) {
+      perror("RC5 FIFO");
+      exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+      repeats = 1;
+      if (sscanf(line, "%u %u %u", &addr, &cmd, &repeats) < 2) {
+        fprintf(stderr, "RC5: expected 'ADDR CMD [REPEATS]'\n");
+        continue;
+      }
+
+      // a remote never starts frames closer than the repeat period
+      toggle = !toggle;
+      if (next < now_ns()) next = now_ns();
+      for (; repeats > 0; repeats--) {
+        rc5_frame(0x3000 | (toggle << 11) | ((addr & 0x1f) << 6) | (cmd & 0x3f), next);
+        next += EMU_RC5FRAME * 1000LL;
+      }
+    }
+
+    fclose(f);
+  }
+
+  return NULL;
+}
+
+/** Start a thread or die
+ *
+ * @param run The thread routine
+ * @param arg Its argument
+ * @private
+ */
+static void start(void *(*run)(void *), void *arg) {
+  pthread_t t;
+
+  if (pthread_create(&t, NULL, run, arg) != 0) {
+    perror("Thread");
+    exit(1);
+  }
+  pthread_detach(t);
+}
+
+/** Print usage
+ *
+ * @param name Name of the command
+ * @private
+ */
+static void usage(char *name) {
+  fprintf(stderr, "  Usage: %s [-v] [-l LINK] [-i FIFO]\n", name);
+  fprintf(stderr, "\nOptions:\n");
+  fprintf(stderr, "\t-v       - print the display whenever it changes\n");
+  fprintf(stderr, "\t-l LINK  - symlink LINK to the pseudo-terminal\n");
+  fprintf(stderr, "\t-i FIFO  - read 'ADDR CMD [REPEATS]' RC5 key presses from FIFO\n");
+  exit(1);
+}
+
+// Public routines
+
+/** Access UDR
+ * In the receive interrupt reads get the received byte, anywhere else
+ * the access is taken as a write for the transmitter.
+ *
+ * @return Pointer to the register
+ */
+volatile uint8_t *emu_udr() {
+  if (inRx) return &rxLatch;
+
+  commit();
+  txPending = true;
+  return &txLatch;
+}
+
+/** Access UCSRA
+ * Writes are applied as on the chip (see ucsra_commit()). TXC reads as
+ * clear, emu_bit() has the real one.
+ *
+ * @return Pointer to the register
+ */
+volatile uint8_t *emu_ucsra() {
+  commit();
+  pthread_mutex_lock(&lock);
+  ucsraLatch = ucsra & ~_BV(TXC);
+  pthread_mutex_unlock(&lock);
+  ucsraPending = true;
+  return &ucsraLatch;
+}
+
+/** Read TCNT1L
+ * Timer1 runs in 8-bit mode, so that is all of the count.
+ *
+ * @return Pointer to the register
+ */
+volatile uint8_t *emu_tcnt1l() {
+  static uint8_t count;
+
+  count = t1_counts() & 0xff;
+  return &count;
+}
+
+/** Read TIFR
+ * Only TOV1 is there: an overflow not delivered yet.
+ *
+ * @return Pointer to the register
+ */
+volatile uint8_t *emu_tifr() {
+  static uint8_t flags;
+
+  flags = (t1_counts() / 256 > t1Done) ? _BV(TOV1) : 0;
+  return &flags;
+}
+
+/** Test a register bit
+ * UCSRA TXC is taken from the hardware, so that reading it does not look
+ * like writing a one to it.
+ *
+ * @param reg The register
+ * @param bit The bit
+ * @return True if set
+ */
+bool emu_bit(volatile uint8_t *reg, int bit) {
+  bool set;
+
+  if ((reg != &ucsraLatch) || (bit != TXC))
+    return *reg & _BV(bit);
+
+  pthread_mutex_lock(&lock);
+  set = ucsra & _BV(TXC);
+  pthread_mutex_unlock(&lock);
+  return set;
+}
+
+/** Let the hardware move while the firmware busy waits
+ */
+void emu_poll() {
+  struct timespec ts;
+
+  commit();
+  hd_sample(PORTB, now_ns());
+  service();
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  if ((ts.tv_nsec += 50000) >= NS) {
+    ts.tv_sec++;
+    ts.tv_nsec -= NS;
+  }
+  pthread_mutex_lock(&lock);
+  pthread_cond_timedwait(&wake, &lock, &ts);
+  pthread_mutex_unlock(&lock);
+}
+
+/** Clear the global interrupt flag
+ * Anything pending is delivered first, on the chip it would not have
+ * waited this long.
+ */
+void emu_cli() {
+  commit();
+  service();
+  iflag = false;
+}
+
+/** Set the global interrupt flag
+ * Anything pending is delivered right away.
+ */
+void emu_sei() {
+  commit();
+  iflag = true;
+  service();
+}
+
+/** Sleep until an interrupt has been delivered
+ * Timer1 overflows wake it too, as they do the chip.
+ */
+void emu_sleep() {
+  long long next;
+
+  commit();
+
+  if (verbose && hdChanged) {
+    hd_dump(stdout);
+    printf("dim %u, overruns %lu, garbled %lu, LCD violations %lu\n", OCR1B, overruns, garbled,
+        hdViolations);
+    fflush(stdout);
+  }
+
+  while (!service()) {
+    next = iflag ? t1_next() : 0;
+    pthread_mutex_lock(&lock);
+    if (iflag && pending())
+      ;
+    else if (next == 0)
+      pthread_cond_wait(&wake, &lock);
+    else if (!wait_until(next)) {
+      pthread_mutex_unlock(&lock);
+      service();
+      return;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+/** Busy wait
+ * Delays follow each other back to back, so a run of short ones does
+ * not drift with the sleep overhead. With the interrupt flag set,
+ * interrupts are delivered as they come, as they would interrupt the
+ * loop on the chip.
+ *
+ * @param us Time to wait
+ */
+void emu_delay_us(double us) {
+  long long now;
+
+  commit();
+  now = now_ns();
+  hd_sample(PORTB, now);
+
+  cpuClock = (cpuClock > now ? cpuClock : now) + (long long)(us * 1000);
+  if (!iflag)
+    sleep_until(cpuClock);
+  else
+    do {
+      service();
+      pthread_mutex_lock(&lock);
+      if (!pending()) wait_until(cpuClock);
+      pthread_mutex_unlock(&lock);
+    } while (now_ns() < cpuClock);
+
+  hd_sample(PORTB, now_ns());
+  service();
+}
+
+/** Wait a few CPU cycles
+ * Too short to sleep for, but the LCD pins are sampled.
+ *
+ * @param cycles Cycles to wait
+ */
+void emu_delay_cycles(unsigned long cycles) {
+  hd_sample(PORTB, now_ns());
+}
+
+// Main routine
+
+int main(int argc, char *argv[]) {
+  struct termios2 tio;
+  char *link, *fifo, *name;
+  int opt, fdSlave;
+
+  link = fifo = NULL;
+  verbose = false;
+
+  while ((opt = getopt(argc, argv, "vl:i:")) != -1)
+    switch (opt) {
+      case 'v': verbose = true; break;
+      case 'l': link = optarg;  break;
+      case 'i': fifo = optarg;  break;
+      default:  usage(argv[0]);
+    }
+
+  if (((fdPty = posix_openpt(O_RDWR | O_NOCTTY)) < 0) ||
+      (grantpt(fdPty) != 0) || (unlockpt(fdPty) != 0) ||
+      ((name = ptsname(fdPty)) == NULL)) {
+    perror("Can't create pseudo-terminal");
+    return 1;
+  }
+
+  // keep the slave open, so the master never sees a hang-up
+  if ((fdSlave = open(name, O_RDWR | O_NOCTTY)) < 0) {
+    perror("Can't open pseudo-terminal");
+    return 1;
+  }
+  ioctl(fdSlave, TCGETS2, &tio);
+  tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+  tio.c_oflag &= ~OPOST;
+  tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  tio.c_cflag = (tio.c_cflag & ~(CSIZE | PARENB)) | CS8;
+  ioctl(fdSlave, TCSETS2, &tio);
+
+  if (link != NULL) {
+    unlink(link);
+    if (symlink(name, link) != 0) {
+      perror("Can't link pseudo-terminal");
+      return 1;
+    }
+  }
+
+  if ((fifo != NULL) && (mkfifo(fifo, 0600) != 0) && (errno != EEXIST)) {
+    perror("Can't create RC5 FIFO");
+    return 1;
+  }
+
+  printf("PTY: %s\n", name);
+  fflush(stdout);
+
+  ucsra = _BV(UDRE);
+  hd_reset();
+
+  start(rx_thread, NULL);
+  start(tx_thread, NULL);
+  if (fifo != NULL)
+    start(rc5_thread, fifo);
+
+  return firmware_main();
+}
@@ -0,0 +1,160 @@
+/** @file
+ * Host emulator hardware abstraction
+ *
+ * The ATtiny2313 as seen by the firmware when built for the host: the
+ * registers it touches are plain variables, and everything with timing
+ * or side effects (UDR, delays, sleep, interrupt flag) goes through the
+ * emulator routines.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef EMU_LIB
+#define EMU_LIB 1
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+// Public defines
+
+// registers
+extern volatile uint8_t DDRA, DDRB, DDRD;
+extern volatile uint8_t PORTA, PORTB, PORTD, PIND;
+extern volatile uint8_t MCUCR, GIMSK, TIMSK;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0;
+extern volatile uint8_t TCCR1A, TCCR1B, OCR1B;
+extern volatile uint8_t UCSRB, UCSRC, UBRRH, UBRRL;
+
+#define UDR (*emu_udr()) //!< Reads pop the receiver, writes feed the transmitter
+#define UCSRA (*emu_ucsra()) //!< Flags as on the chip, writing a one to TXC clears it
+#define TCNT1L (*emu_tcnt1l()) //!< Timer1 count, read only
+#define TIFR (*emu_tifr())   //!< Timer flags, read only and just TOV1
+
+// port B
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+
+// port D
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+
+// MCUCR
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define SE    5
+
+// GIMSK
+#define INT0  6
+#define INT1  7
+
+// TIMSK
+#define OCIE0A 0
+#define TOIE0  1
+#define OCIE0B 2
+#define ICIE1  3
+#define OCIE1B 5
+#define OCIE1A 6
+#define TOIE1  7
+
+// TIFR
+#define TOV1   7
+
+// TCCR0A, TCCR0B
+#define WGM00 0
+#define WGM01 1
+#define CS00  0
+#define CS01  1
+#define CS02  2
+#define WGM02 3
+
+// TCCR1A, TCCR1B
+#define WGM10  0
+#define WGM11  1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define CS10   0
+#define CS11   1
+#define CS12   2
+#define WGM12  3
+#define WGM13  4
+
+// UCSRA
+#define MPCM  0
+#define U2X   1
+#define UPE   2
+#define DOR   3
+#define FE    4
+#define UDRE  5
+#define TXC   6
+#define RXC   7
+
+// UCSRB
+#define TXB8  0
+#define RXB8  1
+#define UCSZ2 2
+#define TXEN  3
+#define RXEN  4
+#define UDRIE 5
+#define TXCIE 6
+#define RXCIE 7
+
+// UCSRC
+#define UCPOL 0
+#define UCSZ0 1
+#define UCSZ1 2
+#define USBS  3
+
+// interrupt vectors
+#define INT0_vect        emu_int0_vect
+#define TIMER1_OVF_vect  emu_timer1_ovf_vect
+#define USART_RX_vect    emu_usart_rx_vect
+#define USART_UDRE_vect  emu_usart_udre_vect
+#define USART_TX_vect    emu_usart_tx_vect
+
+// helpers
+#define _BV(bit)                        (1 << (bit))
+#define bit_is_set(sfr, bit)            emu_bit(&(sfr), bit)
+#define bit_is_clear(sfr, bit)          (!emu_bit(&(sfr), bit))
+#define loop_until_bit_is_set(sfr, bit) do { emu_poll(); } while (bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { emu_poll(); } while (bit_is_set(sfr, bit))
+
+// Public variables
+
+extern bool hdChanged;            //!< Display contents changed since the last dump
+extern unsigned long hdViolations; //!< Instructions sent while the LCD was busy
+
+// Public routines
+
+volatile uint8_t *emu_udr(void);
+volatile uint8_t *emu_ucsra(void);
+volatile uint8_t *emu_tcnt1l(void);
+volatile uint8_t *emu_tifr(void);
+bool emu_bit(volatile uint8_t *reg, int bit);
+void emu_poll(void);
+void emu_cli(void);
+void emu_sei(void);
+void emu_sleep(void);
+void emu_delay_us(double us);
+void emu_delay_cycles(unsigned long cycles);
+
+void hd_reset(void);
+void hd_sample(uint8_t port, long long now);
+void hd_dump(FILE *f);
+
+#endif
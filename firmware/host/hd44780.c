@@ -0,0 +1,190 @@
+/** @file
+ * HD44780 model for the host emulator
+ *
+ * Watches the LCD pins at every delay the firmware makes, latches a
+ * nibble on each falling edge of enable, and runs the resulting
+ * instructions against an in-memory DDRAM (two-line addressing, which a
+ * 20x4 module shows as lines 0, 2, 1, 3).
+ *
+ * Execution times follow the datasheet (270 kHz oscillator), and anything
+ * latched while the controller is still busy is counted as a violation,
+ * as real hardware would ignore it or worse.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <string.h>
+
+#include "emu.h"
+#include "../lcd.h"
+
+// Internal defines
+
+#define HD_EXEC   37000L      //!< Most instructions, in ns
+#define HD_WRITE  41000L      //!< Data write (with the address update), in ns
+#define HD_CLEAR  1520000L    //!< Clear and home, in ns
+#define HD_LINES  4           //!< Lines of the module
+#define HD_CHARS  20          //!< Characters per line
+
+// Internal variables
+
+static const uint8_t rowAddr[HD_LINES] = {0x00, 0x40, 0x14, 0x54};
+
+static uint8_t ddram[0x80];   //!< Display data
+static uint8_t cgram[0x40];   //!< Character generator data
+static uint8_t addr;          //!< Address counter
+static bool cg;               //!< Address counter points at CGRAM
+static bool dec;              //!< Entry mode decrements
+static bool nibbles;          //!< 4-bit interface
+static bool half;             //!< Upper nibble latched, waiting for the lower
+static uint8_t upper;         //!< That upper nibble
+static bool enable;           //!< Enable pin at the last sample
+static uint8_t bus;           //!< Data nibble seen while enable was high
+static bool rs;               //!< Register select seen while enable was high
+static long long busyUntil;   //!< Controller busy until (ns)
+
+// Public variables
+
+bool hdChanged;
+unsigned long hdViolations;
+
+// Internal routines
+
+/** Move the address counter by one
+ *
+ * @private
+ */
+static void advance() {
+  if (cg) {
+    addr = (addr + (dec ? -1 : 1)) & 0x3f;
+    return;
+  }
+
+  if (dec) {
+    if (addr == 0x00) addr = 0x67;
+    else if (addr == 0x40) addr = 0x27;
+    else addr--;
+  } else {
+    if (addr == 0x27) addr = 0x40;
+    else if (addr == 0x67) addr = 0x00;
+    else addr++;
+  }
+}
+
+/** Execute an instruction or data write
+ *
+ * @param data The byte
+ * @param chars True for a data write, false for an instruction
+ * @param now  Current time (ns)
+ * @private
+ */
+static void execute(uint8_t data, bool chars, long long now) {
+  long took = HD_EXEC;
+
+  if (now < busyUntil) {
+    hdViolations++;
+    fprintf(stderr, "HD44780: %s 0x%02x while busy for %lld ns more\n",
+        chars ? "data" : "instruction", data, busyUntil - now);
+  }
+
+  if (chars) {
+    if (cg) cgram[addr] = data;
+    else {
+      hdChanged |= (ddram[addr] != data);
+      ddram[addr] = data;
+    }
+    advance();
+    took = HD_WRITE;
+  } else if (data & LCD_CMD_DGRAM) {
+    addr = data & 0x7f;
+    cg = false;
+  } else if (data & LCD_CMD_CGRAM) {
+    addr = data & 0x3f;
+    cg = true;
+  } else if (data & LCD_CMD_FUNC) {
+    nibbles = !(data & LCD_FUNC_DL);
+  } else if (data & (LCD_CMD_CDSHIFT | LCD_CMD_CTRL)) {
+    // display and cursor shifts are not modelled
+  } else if (data & LCD_CMD_ENTRY) {
+    dec = !(data & LCD_ENTRY_INC);
+  } else if (data & LCD_CMD_HOME) {
+    addr = 0;
+    cg = false;
+    took = HD_CLEAR;
+  } else if (data & LCD_CMD_CLEAR) {
+    hdChanged = true;
+    memset(ddram, ' ', sizeof(ddram));
+    addr = 0;
+    cg = dec = false;
+    took = HD_CLEAR;
+  }
+
+  busyUntil = now + took;
+}
+
+// Public routines
+
+/** Reset the controller
+ * Powers up in 8-bit mode with the display cleared.
+ */
+void hd_reset() {
+  memset(ddram, ' ', sizeof(ddram));
+  memset(cgram, 0, sizeof(cgram));
+  addr = 0;
+  cg = dec = nibbles = half = enable = false;
+  busyUntil = 0;
+  hdChanged = true;
+}
+
+/** Sample the pins
+ *
+ * @param port Value of the LCD port
+ * @param now  Current time (ns)
+ */
+void hd_sample(uint8_t port, long long now) {
+  bool en = port & _BV(LCD_ENABLE);
+
+  if (en) {
+    bus = (port >> LCD_DOFFSET) & 0x0f;
+    rs = port & _BV(LCD_RS);
+  } else if (enable) {
+    if (!nibbles) // upper data lines only, the lower are not wired
+      execute(bus << 4, rs, now);
+    else if (!half) {
+      upper = bus;
+      half = true;
+    } else {
+      half = false;
+      execute((upper << 4) | bus, rs, now);
+    }
+  }
+
+  enable = en;
+}
+
+/** Print what the display shows
+ * Characters outside of printable ASCII (CGRAM glyphs included) are
+ * shown as '#'.
+ *
+ * @param f Where to print
+ */
+void hd_dump(FILE *f) {
+  uint8_t ch;
+  int x, y;
+
+  fprintf(f, "+--------------------+\n");
+  for (y = 0; y < HD_LINES; y++) {
+    fputc('|', f);
+    for (x = 0; x < HD_CHARS; x++) {
+      ch = ddram[rowAddr[y] + x];
+      fputc(((ch >= 0x20) && (ch < 0x7f)) ? ch : '#', f);
+    }
+    fprintf(f, "|\n");
+  }
+  fprintf(f, "+--------------------+\n");
+  hdChanged = false;
+}
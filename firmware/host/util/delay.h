@@ -0,0 +1,16 @@
+/** @file
+ * Host stand-in for util/delay.h
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef EMU_UTIL_DELAY
+#define EMU_UTIL_DELAY 1
+
+#include <avr/io.h>
+
+#define _delay_us(us)                 emu_delay_us(us)
+#define _delay_ms(ms)                 emu_delay_us((ms) * 1000.0)
+#define __builtin_avr_delay_cycles(n) emu_delay_cycles(n)
+
+#endif
@@ -3,6 +3,9 @@
  *
  * Minimal LCD driver (4-bit, 6-pin).
  *
+ * With R/W not wired the busy flag can not be read, so each byte is
+ * followed by the execution time of its instruction class instead.
+ *
  * @author Piotr S. Staszewski
  */
 
@@ -42,18 +45,22 @@ static void lcd_send_nibble(uint8_t data) {
 // Public functions
 
 /** Send raw byte to lcd.
+ * Waits until the lcd is done with it: LCD_CLEAR_US for clear and home,
+ * LCD_EXEC_US for anything else.
  *
  * @param data  The byte to send
  * @param chars True if sending character, false if sending command
- * @param wait  If true wait additional 5 ms
+ * @param wait  If true wait as long as for clear, whatever it is
  */
 void lcd_send_byte(uint8_t data, bool chars, bool wait) {
   if (chars) SET(LCD_CPORT, LCD_RS);
   lcd_send_nibble(data >> 4);
   lcd_send_nibble(data & 0x0f);
   if (chars) CLR(LCD_CPORT, LCD_RS);
-  _delay_ms(1);
-  if (wait) _delay_ms(5);
+  if (wait || (!chars && data < LCD_CMD_ENTRY))
+    _delay_us(LCD_CLEAR_US);
+  else
+    _delay_us(LCD_EXEC_US);
 }
 
 /** Initialise the lcd.
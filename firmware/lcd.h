@@ -12,6 +12,11 @@
 #define LCD_RS      PB5   //!< Register select pin (on LCD_CPORT)
 #define LCD_ENABLE  PB6   //!< Enable pin
 
+// timing (R/W is not wired, so no busy flag; datasheet times at 270 kHz
+// with a margin for a slow oscillator)
+#define LCD_EXEC_US   50    //!< Data writes and most instructions (37-41 us)
+#define LCD_CLEAR_US  2000  //!< Clear and home (1.52 ms)
+
 /** LCD initialisation array.
  * This array should define 4 elements, composed from the appropriate LCD_CMD
  * entries combined with respective LCD_* arguments (if needed).
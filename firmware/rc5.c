@@ -48,6 +48,7 @@ static StateEnum state;                                   //!< Current state
 
 volatile uint16_t rc5Cmd;
 volatile bool rc5HasCmd;
+volatile uint16_t rc5Stamp;
 
 // Public routines
 
@@ -116,6 +117,7 @@ ISR(RC5_ISR) {
   if ((cnt == 0) && ((state == STATE_START1) || (state == STATE_MID0))) {
     state = STATE_END;
     rc5HasCmd = true;
+    rc5Stamp = RC5_CLOCK();
     GIMSK &= ~RC5_GIMSK;
   }
 
@@ -17,6 +17,9 @@
 #define RC5_TCCR    TCCR0       //!< Control registers for that timer
 #define RC5_TSCALE  _BV(CS02)   //!< Prescaler bits for the timer
 
+// stamping
+#define RC5_CLOCK   clk_now     //!< Reads a free-running clock to stamp commands with
+
 // bit durations
 #define RC5_SHORT_MIN 14        //!< 444 us
 #define RC5_SHORT_MAX 42        //!< 1333 us
@@ -36,9 +39,11 @@
 
 extern volatile uint16_t rc5Cmd;  //!< Contains all bits received
 extern volatile bool rc5HasCmd;   //!< Set true when full command has been received
+extern volatile uint16_t rc5Stamp; //!< RC5_CLOCK when the command was received
 
 // Public routines
 
+uint16_t RC5_CLOCK(void);
 void rc5_init(void);
 void rc5_next(void);
 
@@ -4,6 +4,30 @@
  * Recieve commands as simple byte-oriented packets. The first byte indicates the
  * length of the command to receieve, rest is the payload.
  *
+ * Commands are received into CLI_SLOTS slots, so the next one can come in
+ * while the current one is processed. A command that finds all slots full
+ * is read to the end (keeping the framing) and dropped, and the host is
+ * told with an 'o' packet carrying the number of such commands. It goes
+ * out right after the ack of the last command received before them, so
+ * the host sees the replies in the order it sent the commands. The count
+ * stops at 255, a host has to keep fewer commands than that in flight
+ * (irpaneld keeps at most LNK_MAXWINDOW) for it to be exact.
+ *
+ * A command stalled for more than CLI_STALE ticks is given up on, and
+ * the next byte taken as a length, so the framing is found again after
+ * the host went away mid-command. Lengths that do not fit the buffer
+ * are ignored.
+ *
+ * Sending only queues the bytes in a ring, which the data register empty
+ * interrupt drains, so the main loop and the other interrupts keep going
+ * while they go out. With interrupts disabled the ring is not drained, a
+ * full ring is then sent out by hand.
+ *
+ * The host may switch the UART to a faster rate (see uartcli_baud()). The
+ * new rate is on trial until the host confirms it, and if that does not
+ * happen within CLI_TRIAL ticks it is back to CLI_BAUD, so a host that
+ * can not keep up is not locked out.
+ *
  * Can be trivially extended with address byte as the first byte to make a simple
  * bus protocol that can handle upto 256 devices.
  *
@@ -26,12 +50,37 @@
 
 static volatile uint8_t cmdLen = 0; //!< Command length
 static volatile uint8_t cmdPtr = 0; //!< Pointer to current byte
+static bool cmdDrop;                //!< No slot for the current command
+static volatile char slots[CLI_SLOTS][CLI_BUFSIZ]; //!< Received commands
+static volatile uint8_t slotHead = 0;  //!< Oldest received command
+static volatile uint8_t slotCount = 0; //!< Number of received commands
+static volatile uint8_t slotDrops[CLI_SLOTS]; //!< Commands dropped after each one
+static uint16_t cmdLast;            //!< CLI_CLOCK at the last byte
+static bool onTrial = false;        //!< Baud rate not confirmed yet
+static uint16_t trialSince;         //!< CLI_CLOCK when it was switched to
+static volatile uint8_t txRing[CLI_TXSIZ]; //!< Bytes waiting to be sent
+static volatile uint8_t txHead = 0; //!< Next byte to send
+static volatile uint8_t txTail = 0; //!< Where the next byte goes
+static volatile bool txSent = false; //!< Anything loaded since the last flush
 
 // Public variables
 
-volatile char cliBuffer[CLI_BUFSIZ];
+volatile char *cliBuffer = slots[0];
 volatile bool cliHasCmd = false;
 
+// Internal routines
+
+/** Load the oldest queued byte into UDR.
+ * TXC is cleared along, so it is set again only once this byte is out.
+ * @private
+ */
+static void tx_load() {
+  UDR = txRing[txHead];
+  UCSRA |= _BV(TXC); // cleared by writing a one
+  txHead = (txHead + 1) % CLI_TXSIZ;
+  txSent = true;
+}
+
 // Public routines
 
 /** Initialise the UART CLI.
@@ -45,25 +94,109 @@ void uartcli_init() {
 }
 
 /** Indicated ready to receive next command.
- * Has to be called after a command has been processed to enable
- * further processing. One should *never* clear cliHasCmd directly.
+ * Has to be called after a command has been processed (and acked) to
+ * free its slot, cliBuffer then points to the next one. Reports the
+ * commands dropped after it, if any. One should *never* clear cliHasCmd
+ * directly. Call with interrupts disabled.
  *
  * @see cliBuffer
  * @see cliHasCmd
  */
 void uartcli_next() {
-  cliHasCmd = false;
-  cmdLen = 0;
-  cmdPtr = 0;
-  UCSRB |= _BV(RXCIE);
+  if (slotDrops[slotHead] > 0) {
+    uart_send_byte(0x02);         // packet length
+    uart_send_byte((uint8_t)'o'); // overflow code
+    uart_send_byte(slotDrops[slotHead]);
+    slotDrops[slotHead] = 0;
+  }
+  slotHead = (slotHead + 1) % CLI_SLOTS;
+  slotCount--;
+  cliBuffer = slots[slotHead];
+  cliHasCmd = (slotCount > 0);
+}
+
+/** Switch to another baud rate.
+ * Whatever was sent before still goes out at the old rate, by the
+ * interrupt handler. The new one has to be confirmed with
+ * uartcli_confirm(), see uartcli_expire().
+ * Call with interrupts enabled, they are only masked for the switch.
+ *
+ * @param ubrr The baud rate register value
+ * @param u2x  True for double speed
+ */
+void uartcli_baud(uint8_t ubrr, bool u2x) {
+  loop_until_bit_is_clear(UCSRB, UDRIE); // ring empty
+  if (txSent) loop_until_bit_is_set(UCSRA, TXC);
+  txSent = false;
+
+  cli();
+  UBRRH = 0;
+  UBRRL = ubrr;
+  if (u2x) UCSRA |= _BV(U2X);
+  else UCSRA &= ~_BV(U2X);
+  trialSince = CLI_CLOCK();
+  onTrial = true;
+  sei();
+}
+
+/** Confirm the current baud rate.
+ */
+void uartcli_confirm() {
+  onTrial = false;
 }
 
-/** Send signle byte over UART.
+/** Go back to CLI_BAUD if the current rate was not confirmed in time.
+ * Call from the main loop.
+ */
+void uartcli_expire() {
+  uint16_t now;
+
+  if (!onTrial) return;
+
+  cli();
+  now = CLI_CLOCK();
+  sei();
+  if ((uint16_t)(now - trialSince) > CLI_TRIAL) {
+    UBRRH = (CLI_PRESCALE >> 8);
+    UBRRL = CLI_PRESCALE;
+    UCSRA &= ~_BV(U2X);
+    onTrial = false;
+  }
+}
+
+/** Queue signle byte to be sent over UART.
+ * Does not wait, unless the ring is full.
+ *
  * @param data The byte to send
  */
 void uart_send_byte(uint8_t data) {
-  loop_until_bit_is_set(UCSRA, UDRE);
-  UDR = data;
+  uint8_t next = (txTail + 1) % CLI_TXSIZ;
+
+  while (next == txHead) { // full, send the oldest byte by hand
+    loop_until_bit_is_set(UCSRA, UDRE);
+    UCSRB &= ~_BV(UDRIE);
+    if ((next == txHead) && bit_is_set(UCSRA, UDRE))
+      tx_load();
+    UCSRB |= _BV(UDRIE);
+  }
+
+  txRing[txTail] = data;
+  txTail = next;
+  UCSRB |= _BV(UDRIE);
+}
+
+/** Send everything queued and wait until it is out.
+ * That includes what the interrupt handler already moved to UDR.
+ * Call with interrupts disabled.
+ */
+void uart_flush() {
+  UCSRB &= ~_BV(UDRIE);
+  while (txHead != txTail) {
+    loop_until_bit_is_set(UCSRA, UDRE);
+    tx_load();
+  }
+  if (txSent) loop_until_bit_is_set(UCSRA, TXC);
+  txSent = false;
 }
 
 /** Send character string over UART.
@@ -79,14 +212,37 @@ void uart_write_str(char *str) {
 /** UART Recieve interrupt handler.
  */
 ISR(CLI_ISR) {
-  if (cmdLen > cmdPtr) {
-    cliBuffer[cmdPtr] = UDR;
+  uint16_t now = CLI_CLOCK();
+  uint16_t gap = now - cmdLast;
+  uint8_t data = UDR;
+  uint8_t slot = (slotHead + slotCount) % CLI_SLOTS;
+
+  cmdLast = now;
+  if ((cmdLen > cmdPtr) && (gap <= CLI_STALE)) {
+    if (!cmdDrop) slots[slot][cmdPtr] = data;
     cmdPtr++;
-    if (cmdLen == cmdPtr) {
-      cliBuffer[cmdPtr] = 0;
+    if ((cmdLen == cmdPtr) && !cmdDrop) {
+      slots[slot][cmdPtr] = 0;
+      slotCount++;
       cliHasCmd = true;
-      UCSRB &= ~_BV(RXCIE);
     }
-  } else
-    cmdLen = UDR;
+  } else {
+    cmdLen = data;
+    cmdPtr = 0;
+    if (cmdLen >= CLI_BUFSIZ) cmdLen = 0;
+    cmdDrop = (cmdLen > 0) && (slotCount == CLI_SLOTS);
+    if (cmdDrop) { // blame the last one received, still waiting
+      slot = (slotHead + CLI_SLOTS - 1) % CLI_SLOTS;
+      if (slotDrops[slot] < 0xff) slotDrops[slot]++; // see the file comment
+    }
+  }
+}
+
+/** UART Data register empty interrupt handler.
+ * Sends the next queued byte.
+ */
+ISR(CLI_TXISR) {
+  tx_load();
+  if (txHead == txTail)
+    UCSRB &= ~_BV(UDRIE);
 }
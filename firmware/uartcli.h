@@ -4,23 +4,35 @@
 // Configurable defines
 
 #define CLI_BUFSIZ  24            //!< Buffer size (*max cmd length less one that this*).
+#define CLI_SLOTS   2             //!< Commands that can be buffered (advertised to the host)
 #define CLI_BAUD    9600          //!< UART baud
+#define CLI_TXSIZ   12            //!< Transmit ring size (holds one less, an IR packet and an ack fit)
 #define CLI_ISR     USART_RX_vect //!< UART RX vector
+#define CLI_TXISR   USART_UDRE_vect //!< UART data register empty vector
+#define CLI_CLOCK   clk_now       //!< Reads a free-running clock (256 us ticks) to time bytes with
+#define CLI_STALE   390           //!< Ticks between bytes of a command before it is given up on (~100 ms)
+#define CLI_TRIAL   3906          //!< Ticks a new baud rate has to be confirmed within (~1 s)
 
 // Public variables
 
-extern volatile char cliBuffer[]; //!< Command data buffer
-extern volatile bool cliHasCmd;   //!< Set to true when full command has been received
+extern volatile char *cliBuffer;  //!< Command data buffer (the oldest slot)
+extern volatile bool cliHasCmd;   //!< Set to true while a full command is waiting
 
 // Public routines
 
+uint16_t CLI_CLOCK(void);
 void uartcli_init(void);
 void uartcli_next(void);
+void uartcli_baud(uint8_t ubrr, bool u2x);
+void uartcli_confirm(void);
+void uartcli_expire(void);
 void uart_send_byte(uint8_t data);
+void uart_flush(void);
 void uart_write_str(char *str);
 
 // Interrupt handlers
 
 ISR(CLI_ISR);
+ISR(CLI_TXISR);
 
 #endif
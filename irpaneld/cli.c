@@ -2,67 +2,264 @@
  * CLI processing library
  *
  * This library handles the translation of ASCII lines into
- * commands for the irpanel firmware. It ensures data sanity
- * and provides simple state tracking.
+ * changes of the shadow framebuffer (see screen.c), and sends whatever
+ * the planner comes up with to the irpanel firmware on every refresh
+ * tick (or, with no refresh rate, once all input available from a client
+ * has been processed). Writes within a tick only ever reach the panel as
+ * their net result.
+ *
+ * The link is fed a packet at a time, just enough to keep it busy, and
+ * each packet is planned for whoever the scheduler (see sched.c) picks:
+ * a client that just got a key from the user comes first, then normal
+ * clients sharing the link by weight ('r:N'), then the background ones
+ * ('r:0') and repairs of cells no client shows. A repaint from one client
+ * then no longer holds up the feedback to a key press from another.
  * As of now it also does IR packet squashing.
  *
+ * IR events are timed on their way from the remote to the panel: RC5
+ * decode to UART (firmware stamps), UART to the daemon, squashing, the
+ * client reacting, and its changes reaching the link. The histograms can
+ * be queried with 'q:i'.
+ *
+ * Runtime statistics (panel traffic, ack round-trips, errors, IR and
+ * client command counts) can be queried with 'q:s', or dumped to the log
+ * with SIGUSR1. Client commands, connections and poll wakeups go to the
+ * flight recorder (see trace.c), which is dumped on SIGUSR2 or after a
+ * panel error.
+ *
+ * All I/O is multiplexed with epoll, so any number of clients (up to
+ * CLI_MAXCLIENTS) can be connected at once, over TCP and UNIX sockets
+ * alike, all sharing the single panel connection. Nothing is written
+ * directly: replies and events are queued per client and written once per
+ * loop iteration, so whatever a client's input caused leaves in a single
+ * write. Clients that stop reading are dropped once their queue is full.
+ *
+ * With io_uring (-U) the same work is driven by completions instead of
+ * readiness: a read stays posted on every client, and all writes and
+ * re-armed reads go in with the wait, so an update costs one
+ * io_uring_enter() rather than a poll, a read and a write or two.
+ * The epoll path stays the fallback where io_uring is not available.
+ *
+ * Each panel is driven from a thread of its own (see relay.c), so a slow
+ * or silent panel never holds up the clients. Commands are handed to it
+ * through a queue, and what the panel sends comes back through another
+ * one, whose doorbell is watched here like any other FD.
+ *
+ * One daemon can drive several panels (up to CLI_MAXPANELS), each with
+ * its own geometry, screen state, scheduler and link. Clients start out
+ * on the first one and move to another by name with 'a:NAME'; they only
+ * draw on, and get keys from, the panel they are attached to. Everything
+ * else (listeners, the refresh tick, statistics, the flight recorder) is
+ * shared.
+ *
  * @author Piotr S. Staszewski
  */
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#include <fcntl.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
 #include <string.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "cli.h"
+#include "hist.h"
+#include "ioring.h"
 #include "irpaneld.h"
+#include "keys.h"
+#include "link.h"
+#include "outq.h"
+#include "relay.h"
+#include "sched.h"
+#include "screen.h"
+#include "trace.h"
 
 // Internal defines
 
-#define PANEL     0                         //!< Panel index into pfds (for readability)
-#define CLIENT    1                         //!< Client index into pfds
-#define LCD_SIZE  CLI_LCDLINES*CLI_LCDCHARS //!< LCD size in chars/bytes
+#define ID_TICK   0                         //!< Epoll id of the refresh timer
+#define ID_PANEL  1                         //!< Epoll id of the first panel's link thread events
+#define ID_LISTEN (ID_PANEL+CLI_MAXPANELS)  //!< Epoll id of the first listener
+#define ID_CLIENT (ID_LISTEN+CLI_MAXLISTEN) //!< Epoll id of the first client
+#define CLOCK_WRAP (65536L*CLI_FWTICK)       //!< Panel clock period in us
+#define QUERY_MAX 2048                      //!< Longest query reply
+#define TAG_READ  1                         //!< io_uring tag of a read
+#define TAG_POLL  3                         //!< io_uring tag of a poll
+#define FLOW_NONE CLI_MAXCLIENTS                //!< Scheduler flow of cells no client shows
+#define TAG(kind, id, gen) (((uint64_t)(gen) << 32) | ((uint64_t)(id) << 2) | (kind)) //!< Tag for an id
+
+// Internal types and variables
+
+typedef enum {
+  PROTO_UNKNOWN,              //!< Nothing received yet
+  PROTO_ASCII,                //!< Newline terminated text commands
+  PROTO_BINARY                //!< Length-prefixed binary frames
+} Protocol;
+
+typedef struct panel Panel;
+
+typedef struct {
+  int fd;                     //!< Client socket, -1 if slot is free
+  Panel *panel;               //!< Panel it is attached to
+  Protocol proto;             //!< Protocol spoken by the client
+  OutQ out;                   //!< Replies and events on their way to the client
+  bool writing;               //!< Watched for writability (a write in flight with io_uring)
+  unsigned gen;               //!< Bumped for every connection, tells stale completions apart
+  char *in;                   //!< Input ring
+  int inSize;                 //!< Input ring size
+  int inHead;                 //!< Oldest byte in the input ring
+  int inCount;                //!< Bytes in the input ring
+  int inScan;                 //!< Bytes already searched for a newline
+  bool inSkip;                //!< Discarding the rest of an overlong line
+  struct batch *batch;        //!< Open batch, NULL if none
+  Screen scr;                 //!< What the client draws on
+  int z;                      //!< Stacking order, higher is on top
+  unsigned long raised;       //!< When last raised, breaks z ties
+  bool subscribed;            //!< True once a key filter has been set
+  KeyFilter keys;             //!< Keys the client wants
+  long irAt;                  //!< When it was sent an IR event, 0 if reacted
+  long irFrom;                //!< When that event arrived from the panel
+  long keyAt;                 //!< When it was last sent an IR event, 0 if never
+  int weight;                 //!< Share of the panel link, 0 for background
+  unsigned long cmds;         //!< Commands received
+  long since;                 //!< When it connected (us)
+  bool syncing;               //!< Waiting for the panel, input on hold
+  bool held;                  //!< Not read from, while syncing (see client_hold())
+  bool fenced;                //!< Its changes are with the link
+  unsigned long fence;        //!< Link mark to wait for
+} Client;
+
+typedef struct {
+  char code;                  //!< Command code
+  int a;                      //!< First numeric argument
+  int b;                      //!< Second numeric argument
+  int c;                      //!< Third numeric argument
+  int d;                      //!< Fourth numeric argument
+  const char *data;           //!< Print payload
+  int len;                    //!< Print payload length
+} Command;
+
+typedef struct batch {
+  Command cmds[CLI_MAXBATCH]; //!< Commands received so far
+  char data[CLI_BATCHDATA];   //!< Their print payloads
+  int size;                   //!< Commands announced
+  int count;                  //!< Commands received
+  int used;                   //!< Bytes of data used
+  int fail;                   //!< Index of the first bad command, -1 if none
+  const char *err;            //!< Its error message
+  Screen scr;                 //!< Client screen as left by the commands so far
+} Batch;
+
+typedef struct {
+  uint32_t id;                //!< Epoll id of the FD written to
+  uint32_t gen;               //!< Client generation, see Client.gen
+  char data[];                //!< The bytes
+} Send;                       //!< An io_uring write in flight, its address is the tag
+
+struct panel {
+  char name[CLI_MAXNAME+1];   //!< Name clients attach by
+  Display disp;               //!< Screen state and geometry (see screen.c)
+  Sched sched;                //!< Link scheduler (see sched.c)
+  Relay relay;                //!< Link thread (see relay.c)
+  bool deferred;              //!< True if a flush waits for the link
+  Client *focus;              //!< Focused client, NULL if none
+  int cellOwner[SCR_SIZE];    //!< Client slot each cell comes from, -1 if none
+  struct {
+    int addr;
+    int cmd;
+    int count;
+    long first;               //!< When the first one arrived
+  } irpkt;                    //!< For IR packet squashing
+  struct {
+    long base[2];             //!< Smallest offset, this and the last span
+    int spans;                //!< Spans seen, up to 2
+    long since;               //!< When this span started
+  } clock;                    //!< Panel to daemon clock offset
+  long reactAt;               //!< Command reacting to IR, 0 if none
+  long reactFrom;             //!< When that IR arrived
+};
+
+static const char ERR_UNKNOWN[] = "command unknown"; //!< Replied with 'fail:'
 
-// Internal variables
+static int fdEpoll;                         //!< For polling
+static int fdTick;                          //!< Refresh timer, -1 if none
+static bool ticking;                        //!< True while the timer is armed
+static bool ring;                           //!< Doing the I/O with io_uring
+static char ringIn[CLI_MAXCLIENTS][2][CLI_CLIENTBUF]; //!< Client read buffers for io_uring, by generation parity
+static int fdListen[CLI_MAXLISTEN];         //!< Listening sockets
+static int numListen;                       //!< Number of listening sockets
+static Client clients[CLI_MAXCLIENTS];      //!< Client slots
+static Client *cur;                         //!< Client whose command is processed
+static unsigned long raiseCount;            //!< Source of Client.raised stamps
+static Panel panels[CLI_MAXPANELS];         //!< Panels, in the order added
+static int numPanels;                       //!< Number of panels
 
-static struct pollfd pfds[2]; //!< For polling
+typedef enum {
+  LAT_DECODE,                 //!< RC5 decoded to sent over UART
+  LAT_SERIAL,                 //!< Sent over UART to read by the daemon
+  LAT_SQUASH,                 //!< Read by the daemon to sent to clients
+  LAT_CLIENT,                 //!< Sent to a client to its next command
+  LAT_FLUSH,                  //!< That command to its changes sent to the panel
+  LAT_TOTAL,                  //!< Read by the daemon to changes sent to the panel
+  LAT_STAGES
+} Stage;
 
-static struct state {
-  unsigned char x;
-  unsigned char y;
-  unsigned char dim;
-  char buf[LCD_SIZE];
-} lcdState;                   //!< Keeps current state of the LCD
+static const char *stageName[LAT_STAGES] = {
+  "decode", "serial", "squash", "client", "flush", "total"
+};
 
-static struct packet {
-  int addr;
-  int cmd;
-  int count;
-} irpkt;                      //!< For IR packet squashing
+static Hist latency[LAT_STAGES];            //!< IR latency by stage
 
-static FILE *fPanel;          //!< For formatted output to panel (write-only)
-static FILE *fClient;         //!< For formatted output to client (write-only)
+static struct {
+  long started;               //!< When the daemon started (us)
+  unsigned long irIn;         //!< IR packets received
+  unsigned long irOut;        //!< IR events sent to clients
+  unsigned long cmds;         //!< Client commands
+  unsigned long errors;       //!< Client commands refused
+  unsigned long unknown;      //!< Unknown packets from the panel
+} stats;                      //!< Runtime statistics
 
-static unsigned char bufPanelIn[CLI_PANELBUF];  //!< Panel input buffer
-static unsigned char bufPanelOut[CLI_PANELBUF]; //!< Panel output buffer
-static char bufClient[CLI_CLIENTBUF];           //!< Client input buffer
+static unsigned char bufPlan[SCR_PLANBUF];  //!< Planned packets
+static char bufLine[CLI_MAXLINE+1];         //!< For lines wrapping around a ring
 
 // Internal routines
 
 // client reply helpers
 
+/** Send binary frame to client
+ *
+ * @param c    The client
+ * @param code Reply code
+ * @param data Reply data
+ * @param len  Length of data
+ * @private
+ */
+static void say_frame(Client *c, char code, const void *data, int len) {
+  unsigned char head[2] = {len + 1, code};
+
+  outq_put(&c->out, head, 2);
+  outq_put(&c->out, data, len);
+}
+
 /** Send error reply to client
  *
  * @param msg The error message (argument)
  * @private
  */
 static void say_error(const char *msg) {
-  fprintf(fClient, "error:%s\n", msg);
+  if (cur->proto == PROTO_BINARY)
+    say_frame(cur, 'e', msg, strlen(msg));
+  else if (msg == ERR_UNKNOWN)
+    outq_printf(&cur->out, "fail:%s\n", msg);
+  else
+    outq_printf(&cur->out, "error:%s\n", msg);
 }
 
 /** Send ok reply to client
@@ -70,337 +267,1848 @@ static void say_error(const char *msg) {
  * @private
  */
 static void say_ok() {
-  fprintf(fClient, "ok\n");
+  if (cur->proto == PROTO_BINARY)
+    say_frame(cur, 'k', NULL, 0);
+  else
+    outq_printf(&cur->out, "ok\n");
 }
 
-// packet IO for panel
-
-/** Read packet from panel
- * This will warn when things are wrong, and if it does everything will
- * probably break. This is not handled as of now.
- * Reads packet into bufPanelIn.
+/** Publish IR event to subscribed clients
+ * Only clients attached to the panel get it. Clients that never set a key
+ * filter get every event, as 'ir:ADDR:CMD'. The rest only get the keys
+ * their filter matches, by name if the key map has one for it.
  *
- * @see bufPanelIn
- * @return True if full packet read
+ * @param p    The panel it came from
+ * @param addr RC5 address
+ * @param cmd  RC5 command
+ * @param from When the event arrived from the panel
  * @private
  */
-static bool read_packet() {
-  bool ret;
-  unsigned char len, pos, tries;
+static void say_ir(Panel *p, unsigned char addr, unsigned char cmd, long from) {
+  unsigned char data[2] = {addr, cmd};
+  const char *name;
+  Client *c;
+  long now;
+  int code, i;
 
-  ret = false;
-  len = pos = tries = 0;
+  now = hist_now();
+  hist_add(&latency[LAT_SQUASH], now - from);
+  stats.irOut++;
 
-  bzero(&bufPanelIn, sizeof(bufPanelIn));
+  code = KEY_CODE(addr, cmd);
+  name = keys_name(code);
 
-  if (fcntl(fdPanel, F_SETFL, fcntl(fdPanel, F_GETFL) & ~O_NONBLOCK) == -1)
-    warn("Can't change PANEL FD to blocking");
+  for (i = 0; i < CLI_MAXCLIENTS; i++) {
+    c = &clients[i];
+    if ((c->fd < 0) || (c->panel != p)) continue;
 
-  while (read(fdPanel, &len, 1) != 1) {
-    warn("Can't read packet length");
-    if (++tries > 3) {
-      warn("Not trying any more...");
-      return ret;
+    if (c->subscribed) {
+      if (!keys_match(&c->keys, code)) continue;
+      if (c->keys.focused && (p->focus != c)) continue;
     }
-  }
 
-  if ((len < 1) || (len > CLI_PANELBUF))
-    warn("Payload length larger than available buffer");
-  else {
-    while (pos < len)
-      if (read(fdPanel, &bufPanelIn[pos], 1) == 1) pos++;
-    ret = true;
+    if (c->subscribed && (name != NULL)) {
+      if (c->proto == PROTO_BINARY) say_frame(c, 'n', name, strlen(name));
+      else outq_printf(&c->out, "key:%s\n", name);
+    } else {
+      if (c->proto == PROTO_BINARY) say_frame(c, 'i', data, 2);
+      else outq_printf(&c->out, "ir:%u:%u\n", addr, cmd);
+    }
+    c->irAt = c->keyAt = now;
+    c->irFrom = from;
   }
+}
 
-  if (fcntl(fdPanel, F_SETFL, fcntl(fdPanel, F_GETFL) | O_NONBLOCK) == -1)
-    warn("Can't change PANEL FD to non-blocking");
+// input processing
 
-  return ret;
+/** Wrap a panel clock difference into (-CLOCK_WRAP/2, CLOCK_WRAP/2]
+ *
+ * @param us The difference in us
+ * @return The wrapped difference
+ * @private
+ */
+static long clock_wrap(long us) {
+  us %= CLOCK_WRAP;
+  if (us <= -CLOCK_WRAP/2) us += CLOCK_WRAP;
+  if (us > CLOCK_WRAP/2) us -= CLOCK_WRAP;
+  return us;
 }
 
-/** Send packet to panel
- * Sends contents of bufPanelOut, which has to be properly setup before.
- * It will also check for a reply packet.
+/** Record the firmware stages of an IR event
+ * The panel clock is not synchronised with ours, so the UART stage is
+ * measured against the smallest offset between the two seen in the last
+ * one or two CLI_CLOCKSPAN seconds (which also keeps clock drift out).
+ * That makes it the delay on top of the fastest event seen.
  *
- * @see bufPanelOut
- * @see read_packet
- * @return True if everything ok
+ * @param p   The panel
+ * @param pkt The packet (length-prefixed)
+ * @param now When it arrived
  * @private
  */
-static bool send_packet() {
-  if (fwrite(&bufPanelOut, 1, bufPanelOut[0]+1, fPanel) == (bufPanelOut[0]+1)) {
-    fflush(fPanel);
-    if (!(read_packet() && (bufPanelIn[0] == 'd'))) {
-      say_error("firmware error");
-      return false;
-    }
-    return true;
-  } else {
-    say_error("write failed");
-    return false;
-  }
+static void ir_stamps(Panel *p, const unsigned char *pkt, long now) {
+  unsigned int decoded, sent;
+  long offset, base;
+
+  if (pkt[0] != 7) return; // firmware without stamps
+
+  decoded = pkt[4] | (pkt[5] << 8);
+  sent = pkt[6] | (pkt[7] << 8);
+  hist_add(&latency[LAT_DECODE], (long)((sent - decoded) & 0xffff) * CLI_FWTICK);
+
+  offset = clock_wrap(now - (long)sent * CLI_FWTICK);
+  if ((p->clock.spans == 0) || (now - p->clock.since > CLI_CLOCKSPAN * 1000000L)) {
+    p->clock.base[1] = p->clock.base[0];
+    p->clock.base[0] = offset;
+    p->clock.since = now;
+    if (p->clock.spans < 2) p->clock.spans++;
+  } else if (clock_wrap(offset - p->clock.base[0]) < 0)
+    p->clock.base[0] = offset;
+
+  base = p->clock.base[0];
+  if ((p->clock.spans > 1) && (clock_wrap(p->clock.base[1] - base) < 0))
+    base = p->clock.base[1];
+  hist_add(&latency[LAT_SERIAL], clock_wrap(offset - base));
 }
 
-// input processing
+/** Note that the current client reacted
+ * The first command after an IR event closes its client stage.
+ *
+ * @private
+ */
+static void reacted() {
+  long now;
+
+  if (cur->irAt == 0) return;
+
+  now = hist_now();
+  hist_add(&latency[LAT_CLIENT], now - cur->irAt);
+  if (cur->panel->reactAt == 0) {
+    cur->panel->reactAt = now;
+    cur->panel->reactFrom = cur->irFrom;
+  }
+  cur->irAt = 0;
+}
 
 /** Process panel input
  * Do actions based on received packets.
  * Will squash IR packets.
  *
- * @see bufPanelIn
+ * @param ctx The panel
+ * @param pkt The packet (length-prefixed)
  * @private
  */
-static void cli_panel_input() {
-  switch (bufPanelIn[0]) {
+static void cli_panel_input(void *ctx, const unsigned char *pkt) {
+  Panel *p = ctx;
+  long now = hist_now();
+
+  switch (pkt[1]) {
     case 'i': // IR input
+      stats.irIn++;
+      ir_stamps(p, pkt, now);
       if (squash > 1) {
-        if (irpkt.count > 0) {
-          if ((irpkt.addr == bufPanelIn[1]) && (irpkt.cmd == bufPanelIn[2])) {
-            if (++irpkt.count >= squash) {
-              fprintf(fClient, "ir:%d:%d\n", irpkt.addr, irpkt.cmd);
-              irpkt.count = 0;
+        if (p->irpkt.count > 0) {
+          if ((p->irpkt.addr == pkt[2]) && (p->irpkt.cmd == pkt[3])) {
+            if (++p->irpkt.count >= squash) {
+              say_ir(p, p->irpkt.addr, p->irpkt.cmd, p->irpkt.first);
+              p->irpkt.count = 0;
             }
-          } else
-            irpkt.count = 1;
-        } else irpkt.count++;
-        irpkt.addr = bufPanelIn[1];
-        irpkt.cmd = bufPanelIn[2];
+          } else {
+            p->irpkt.count = 1;
+            p->irpkt.first = now;
+          }
+        } else {
+          p->irpkt.count++;
+          p->irpkt.first = now;
+        }
+        p->irpkt.addr = pkt[2];
+        p->irpkt.cmd = pkt[3];
       } else
-        fprintf(fClient, "ir:%u:%u\n", bufPanelIn[1], bufPanelIn[2]);
-
-      fflush(fClient);
+        say_ir(p, pkt[2], pkt[3], now);
       break;
 
     default:
-      note("<< Unknown packet: '%s'", bufPanelIn);
+      note("<< Unknown packet from %s: '%s'", p->name, pkt + 1);
+      stats.unknown++;
       break;
   }
 }
 
-/** Process client input
- * Works on chunks of the input string.
+/** Panel link callback for commands never acked
+ *
+ * @param ctx The panel
+ * @param pkt The packet (length-prefixed)
+ * @private
+ */
+static void cli_panel_lost(void *ctx, const unsigned char *pkt) {
+  Panel *p = ctx;
+
+  screen_lost(&p->disp, pkt);
+}
+
+/** Find a panel by name
  *
- * @param line The line to process (null-terminated)
+ * @param name The name
+ * @param len  Its length
+ * @return The panel, NULL if there is none by that name
  * @private
  */
-static void cli_client_input(char *line) {
-  int a, b, c;
+static Panel *panel_find(const char *name, int len) {
+  int i;
+
+  for (i = 0; i < numPanels; i++)
+    if ((strlen(panels[i].name) == len) && (memcmp(panels[i].name, name, len) == 0))
+      return &panels[i];
+  return NULL;
+}
 
-  dbg(printf("CLI << %s\n", line));
-  bzero(&bufPanelOut, CLI_PANELBUF);
+/** Parse an ASCII command line
+ *
+ * @param line The line to parse (null-terminated)
+ * @param cmd  Where to put the command
+ * @return NULL if parsed, the error message otherwise
+ * @private
+ */
+static const char *parse_line(char *line, Command *cmd) {
+  bzero(cmd, sizeof(*cmd));
+  cmd->code = line[0];
 
   switch (line[0]) {
     case 'q': // query LCD state
-      dbg(printf(">> CMD: QUERY\n"));
-      a = strlen(line) - 2;
-      if (a != 1)
-        say_error("argument length error");
-      else
-        switch (line[2]) {
-          case 'p': // position
-            fprintf(fClient, "ok:%u:%u\n", lcdState.x, lcdState.y);
-            break;
-
-          case 'd': // dim value
-            fprintf(fClient, "ok:%u\n", lcdState.dim);
-            break;
-
-          case 'l': // contents of the LCD (single line)
-            fprintf(fClient, "ok:%s\n", lcdState.buf);
-            break;
-
-          default:
-            note(">> Unknown query");
-            fprintf(fClient, "fail:command unknown\n");
-            break;
-        }
+      if (strlen(line) != 3) return "argument length error";
+      cmd->a = line[2];
       break;
 
     case 'p': // print line to LCD
-      dbg(printf(">> CMD: PRINT LINE\n"));
-      a = strlen(line) - 2;
-      if ((a < 1) || (a > LCD_SIZE))
-        say_error("argument length error");
-      else {
-        for (b = 0; b < a;) {
-          c = a - b;
-          if (c > (CLI_LCDCHARS - lcdState.x))
-            c = CLI_LCDCHARS - lcdState.x;
-
-          bufPanelOut[0] = c+1;
-          bufPanelOut[1] = 'p';
-          strncpy((char *)&bufPanelOut+2, line+b+2, c);
-
-          if (!send_packet()) return;
-          else {
-            strncpy((char *)&lcdState.buf+(lcdState.x + CLI_LCDCHARS*lcdState.y), line+b+2, c);
-            b += c;
-
-            // handle moving to the right next line
-            if ((lcdState.x + c) >= CLI_LCDCHARS) {
-              bufPanelOut[0] = 3;
-              bufPanelOut[1] = 'g';
-              bufPanelOut[2] = 0;
-              bufPanelOut[3] = lcdState.y + 1;
-
-              if (bufPanelOut[3] >= CLI_LCDLINES)
-                bufPanelOut[3] = 0;
-
-              if (!send_packet()) return;
-              else {
-                lcdState.x = bufPanelOut[2];
-                lcdState.y = bufPanelOut[3];
-              }
-            } else
-              lcdState.x += c;
-          }
-        }
-        say_ok();
-      }
+      cmd->len = strlen(line) - 2;
+      if ((cmd->len < 1) || (cmd->len > SCR_SIZE))
+        return "argument length error";
+      cmd->data = line + 2;
       break;
 
     case 'g': // move cursor to specified position
-      if (sscanf(line, "g:%d:%d", &a, &b) != 2)
-        say_error("parse failed");
-      else {
-        dbg(printf(">> CMD: GOTO X=%d Y=%d\n", a, b));
-        if (((a < 0) || (a > (CLI_LCDCHARS-1))) || ((b < 0) || (b > (CLI_LCDLINES-1))))
-          say_error("argument out of range");
-        else {
-          bufPanelOut[0] = 3;
-          bufPanelOut[1] = 'g';
-          bufPanelOut[2] = a;
-          bufPanelOut[3] = b;
-          if (send_packet()) {
-            lcdState.x = a;
-            lcdState.y = b;
-            say_ok();
-          }
-        }
-      }
+      if (sscanf(line, "g:%d:%d", &cmd->a, &cmd->b) != 2)
+        return "parse failed";
       break;
 
     case 'd': // set dim value
-      if (sscanf(line, "d:%d", &a) != 1)
-        say_error("parse failed");
-      else {
-        dbg(printf(">> CMD: BRIGHTNESS=%d\n", a));
-        if ((a < 0) || (a > 255)) {
-          say_error("argument out of range");
-          break;
-        }
-        bufPanelOut[0] = 2;
-        bufPanelOut[1] = 'd';
-        bufPanelOut[2] = a;
-        if (send_packet()) {
-          lcdState.dim = a;
-          say_ok();
-        }
-      }
+      if (sscanf(line, "d:%d", &cmd->a) != 1)
+        return "parse failed";
       break;
 
-    case 'c': // clear LCD
-      dbg(printf(">> CMD: CLEAR\n"));
-      bufPanelOut[0] = 1;
-      bufPanelOut[1] = 'c';
-      if (send_packet()) {
-        lcdState.x = lcdState.y = 0;
-        memset(&lcdState.buf, ' ', LCD_SIZE);
-        say_ok();
-      }
+    case 'b': // batch of commands follows
+      if (sscanf(line, "b:%d", &cmd->a) != 1)
+        return "parse failed";
+      break;
+
+    case 'w': // set window on the panel
+      if (sscanf(line, "w:%d:%d:%d:%d", &cmd->a, &cmd->b, &cmd->c, &cmd->d) != 4)
+        return "parse failed";
+      break;
+
+    case 'z': // set stacking order
+      if (sscanf(line, "z:%d", &cmd->a) != 1)
+        return "parse failed";
+      break;
+
+    case 'r': // set share of the link
+      if (sscanf(line, "r:%d", &cmd->a) != 1)
+        return "parse failed";
+      break;
+
+    case 's': // subscribe to keys
+      if ((line[1] != ':') || (strlen(line) - 2 > KEY_MAXSPEC))
+        return "argument length error";
+      cmd->data = line + 2;
+      cmd->len = strlen(line) - 2;
+      break;
+
+    case 'a': // attach to a panel
+      if ((line[1] != ':') || (strlen(line) < 3) || (strlen(line) - 2 > CLI_MAXNAME))
+        return "argument length error";
+      cmd->data = line + 2;
+      cmd->len = strlen(line) - 2;
       break;
 
+    case 'c': // clear LCD
     case 'h': // home LCD
-      dbg(printf(">> CMD: HOME\n"));
-      bufPanelOut[0] = 1;
-      bufPanelOut[1] = 'h';
-      if (send_packet()) {
-        lcdState.x = lcdState.y = 0;
-        say_ok();
-      }
+    case 'f': // take focus
+    case 'y': // sync with the panel
       break;
 
     default:
-      note(">> Unknown command");
-      fprintf(fClient, "fail:command unknown\n");
+      return ERR_UNKNOWN;
+  }
+
+  return NULL;
+}
+
+/** Parse a binary command frame
+ * The frame is the payload of a length-prefixed packet, the first byte
+ * being the command code, just like the firmware packets. Print payloads
+ * are taken as they are, any byte value included.
+ *
+ * @param frame The frame payload
+ * @param len   Length of the payload
+ * @param cmd   Where to put the command
+ * @return NULL if parsed, the error message otherwise
+ * @private
+ */
+static const char *parse_frame(const unsigned char *frame, int len, Command *cmd) {
+  bzero(cmd, sizeof(*cmd));
+  cmd->code = frame[0];
+
+  switch (frame[0]) {
+    case 'q':
+    case 'd':
+    case 'b':
+    case 'r':
+      if (len != 2) return "argument length error";
+      cmd->a = frame[1];
+      break;
+
+    case 'p':
+      if (len < 2) return "argument length error";
+      cmd->data = (const char *)frame + 1;
+      cmd->len = len - 1;
+      break;
+
+    case 'g':
+      if (len != 3) return "argument length error";
+      cmd->a = frame[1];
+      cmd->b = frame[2];
+      break;
+
+    case 'w':
+      if (len != 5) return "argument length error";
+      cmd->a = frame[1];
+      cmd->b = frame[2];
+      cmd->c = frame[3];
+      cmd->d = frame[4];
+      break;
+
+    case 'z':
+      if (len != 2) return "argument length error";
+      cmd->a = (signed char)frame[1];
+      break;
+
+    case 's':
+      if (len - 1 > KEY_MAXSPEC) return "argument length error";
+      cmd->data = (const char *)frame + 1;
+      cmd->len = len - 1;
+      break;
+
+    case 'a':
+      if ((len < 2) || (len - 1 > CLI_MAXNAME)) return "argument length error";
+      cmd->data = (const char *)frame + 1;
+      cmd->len = len - 1;
+      break;
+
+    case 'c':
+    case 'h':
+    case 'f':
+    case 'y':
+      if (len != 1) return "argument length error";
       break;
+
+    default:
+      return ERR_UNKNOWN;
   }
+
+  return NULL;
 }
 
-// Public routines
+/** Parse a key filter spec
+ *
+ * @param cmd The subscribe command
+ * @param f   Where to put the filter
+ * @return NULL if valid, the error message otherwise
+ * @private
+ */
+static const char *subscribe(const Command *cmd, KeyFilter *f) {
+  char spec[KEY_MAXSPEC+1];
 
-/** Setup the CLI library
+  memcpy(spec, cmd->data, cmd->len);
+  spec[cmd->len] = 0;
+  return keys_filter(f, spec);
+}
+
+/** Check command arguments
+ *
+ * @param cmd The command
+ * @param c   The client it is meant for
+ * @param s   Its screen, as the command would find it
+ * @return NULL if valid, the error message otherwise
+ * @private
  */
-void cli_setup() {
-  pfds[PANEL].fd = fdPanel;
-  pfds[PANEL].events = POLLIN;
-  pfds[CLIENT].events = POLLIN;
+static const char *check(const Command *cmd, const Client *c, const Screen *s) {
+  const Screen *lcd = &c->panel->disp.lcd;
+  KeyFilter f;
+
+  switch (cmd->code) {
+    case 's':
+      return subscribe(cmd, &f);
+
+    case 'a':
+      if (panel_find(cmd->data, cmd->len) == NULL)
+        return "no such panel";
+      break;
 
-  if ((fPanel = fdopen(fdPanel, "w")) == NULL)
-    die("Error converting PANEL FD to FILE");
+    case 'q':
+      if ((cmd->a != 'p') && (cmd->a != 'd') && (cmd->a != 'l') &&
+          (cmd->a != 'i') && (cmd->a != 's') && (cmd->a != 'a'))
+        return ERR_UNKNOWN;
+      break;
+
+    case 'g':
+      if (((cmd->a < 0) || (cmd->a > (s->w-1))) || ((cmd->b < 0) || (cmd->b > (s->h-1))))
+        return "argument out of range";
+      break;
+
+    case 'w':
+      if ((cmd->a < 0) || (cmd->b < 0) || (cmd->c < 1) || (cmd->d < 1) ||
+          (cmd->a + cmd->c > lcd->w) || (cmd->b + cmd->d > lcd->h))
+        return "argument out of range";
+      break;
+
+    case 'z':
+      if ((cmd->a < -128) || (cmd->a > 127))
+        return "argument out of range";
+      break;
+
+    case 'd':
+      if ((cmd->a < 0) || (cmd->a > 255))
+        return "argument out of range";
+      break;
+
+    case 'r':
+      if ((cmd->a < 0) || (cmd->a > SCH_MAXWEIGHT))
+        return "argument out of range";
+      break;
+
+    case 'b':
+      if ((cmd->a < 1) || (cmd->a > CLI_MAXBATCH))
+        return "argument out of range";
+      break;
+  }
 
-  bzero(&lcdState, sizeof(lcdState));
-  memset(&lcdState.buf, ' ', LCD_SIZE);
-  lcdState.dim = 128;
+  return NULL;
 }
 
-/** Main processing loop
- * Requires appropriate FDs setup.
+/** Attach a client to a panel
+ * Its screen is reset to cover the whole of the new panel, showing what
+ * the panel shows.
+ *
+ * @param c The client
+ * @param p The panel
+ * @private
+ */
+static void attach(Client *c, Panel *p) {
+  if (c->panel == p) return;
+
+  if ((c->panel != NULL) && (c->panel->focus == c))
+    c->panel->focus = NULL;
+  c->panel = p;
+  c->scr = p->disp.lcd;
+  c->scr.x = c->scr.y = 0;
+  c->irAt = 0;
+  sched_reset(&p->sched, c - clients, c->weight);
+}
+
+/** Apply a command to a client's screen
+ * The command has to be valid (see check()).
  *
- * @see fdPanel
- * @see fdClient
+ * @param cmd The command
+ * @param c   The client
+ * @private
  */
-void cli_loop() {
-  char *line;
-  int count;
+static void apply(const Command *cmd, Client *c) {
+  Screen *s = &c->scr;
 
-  pfds[CLIENT].fd = fdClient;
-  irpkt.count = 0;
+  switch (cmd->code) {
+    case 'p':
+      dbg(printf(">> CMD: PRINT LINE\n"));
+      screen_write(s, cmd->data, cmd->len);
+      break;
 
-  if ((fClient = fdopen(fdClient, "w")) == NULL) {
-    warn("Error converting CLIENT FD to FILE");
-    return;
+    case 'g':
+      dbg(printf(">> CMD: GOTO X=%d Y=%d\n", cmd->a, cmd->b));
+      s->x = cmd->a;
+      s->y = cmd->b;
+      break;
+
+    case 'd':
+      dbg(printf(">> CMD: BRIGHTNESS=%d\n", cmd->a));
+      s->dim = cmd->a;
+      break;
+
+    case 'c':
+      dbg(printf(">> CMD: CLEAR\n"));
+      screen_clear(s);
+      break;
+
+    case 'h':
+      dbg(printf(">> CMD: HOME\n"));
+      s->x = s->y = 0;
+      break;
+
+    case 'w':
+      dbg(printf(">> CMD: WINDOW %d,%d %dx%d\n", cmd->a, cmd->b, cmd->c, cmd->d));
+      screen_resize(s, cmd->a, cmd->b, cmd->c, cmd->d);
+      break;
+
+    case 'z':
+      dbg(printf(">> CMD: Z=%d\n", cmd->a));
+      c->z = cmd->a;
+      break;
+
+    case 'r':
+      dbg(printf(">> CMD: WEIGHT=%d\n", cmd->a));
+      c->weight = cmd->a;
+      sched_reset(&c->panel->sched, c - clients, c->weight);
+      break;
+
+    case 'a':
+      dbg(printf(">> CMD: ATTACH\n"));
+      attach(c, panel_find(cmd->data, cmd->len));
+      break;
+
+    case 'f':
+      dbg(printf(">> CMD: FOCUS\n"));
+      c->panel->focus = c;
+      c->raised = ++raiseCount;
+      break;
+
+    case 's':
+      dbg(printf(">> CMD: SUBSCRIBE\n"));
+      subscribe(cmd, &c->keys);
+      c->subscribed = true;
+      break;
   }
+}
+
+/** Format the runtime statistics
+ * As 'NAME=VALUE' pairs separated by sep. The link and scheduler figures
+ * are those of one panel, the rest are for the whole daemon. The
+ * round-trip time is given as min/mean/p99/max (p99 estimated from the
+ * histogram), all times are in us.
+ * Bytes sent to the panel by scheduler class are given as
+ * interactive/normal/background.
+ *
+ * @param p    The panel
+ * @param out  Where to put the text
+ * @param size Space available in out
+ * @param sep  Pair separator
+ * @return Length of the text (see snprintf)
+ * @private
+ */
+static int stats_format(Panel *p, char *out, int size, const char *sep) {
+  LinkStats *l = &p->relay.link.stats;
+  unsigned long *sb = p->sched.bytes;
+  double up;
+  int i, n;
+
+  up = (hist_now() - stats.started) / 1e6;
+  for (i = n = 0; i < CLI_MAXCLIENTS; i++)
+    if (clients[i].fd >= 0) n++;
+
+  return snprintf(out, size,
+      "uptime=%.0f%spanel=%s%spanels=%d%sbaud=%d%s"
+      "pkt_out=%lu%sbytes_out=%lu%spkt_in=%lu%sbytes_in=%lu%s"
+      "rtt=%ld/%ld/%ld/%ld%s"
+      "lost=%lu%sgarbage=%lu%spartial=%lu%sunknown=%lu%srefused=%lu%sretries=%lu%s"
+      "dropped=%lu%sreopens=%lu%soverflows=%lu%s"
+      "blocked=%lu%sblocked_max=%ld%s"
+      "ir_in=%lu%sir_squashed=%lu%sir_out=%lu%s"
+      "clients=%d%scmds=%lu%scmd_rate=%.2f%scmd_errors=%lu%s"
+      "sched=%lu/%lu/%lu%s"
+      "io=%s%ssyscalls=%lu",
+      up, sep, p->name, sep, numPanels, sep, STAT_GET(p->relay.link.speed), sep,
+      STAT_GET(l->pktOut), sep, STAT_GET(l->bytesOut), sep,
+      STAT_GET(l->pktIn), sep, STAT_GET(l->bytesIn), sep,
+      STAT_GET(l->rtt.min), hist_mean(&l->rtt), hist_quantile(&l->rtt, 990), STAT_GET(l->rtt.max), sep,
+      STAT_GET(l->lost), sep, STAT_GET(l->garbage), sep, STAT_GET(l->partial), sep, stats.unknown, sep,
+      STAT_GET(l->refused), sep, STAT_GET(l->retries), sep,
+      STAT_GET(l->dropped), sep, STAT_GET(l->reopens), sep, STAT_GET(l->overflows), sep,
+      STAT_GET(l->blocked.sum), sep, STAT_GET(l->blocked.max), sep,
+      stats.irIn, sep, stats.irIn - stats.irOut, sep, stats.irOut, sep,
+      n, sep, stats.cmds, sep, (up > 0) ? stats.cmds / up : 0.0, sep, stats.errors, sep,
+      sb[SCH_INTERACTIVE], sb[SCH_NORMAL], sb[SCH_BACKGROUND], sep,
+      ring ? "uring" : "epoll", sep, ioCalls);
+}
 
-  while ((count = read(fdPanel, &bufClient, sizeof(bufClient))) > 0) {
-    note("Dumping stale panel data...");
+/** Write the runtime statistics to the log
+ * For every panel, along with the command rate of every connected client.
+ *
+ * @private
+ */
+static void stats_dump() {
+  char text[QUERY_MAX];
+  Client *c;
+  double up;
+  int i;
+
+  for (i = 0; i < numPanels; i++) {
+    stats_format(&panels[i], text, sizeof(text), ", ");
+    note("Stats: %s", text);
   }
 
-  while (true) {
-    if (poll(pfds, 2, -1) < 0) {
-      warn("Error on poll");
+  for (i = 0; i < CLI_MAXCLIENTS; i++) {
+    c = &clients[i];
+    if (c->fd < 0) continue;
+    up = (hist_now() - c->since) / 1e6;
+    note("Stats: client %d: panel=%s, cmds=%lu, cmd_rate=%.2f", i, c->panel->name,
+        c->cmds, (up > 0) ? c->cmds / up : 0.0);
+  }
+}
+
+/** Answer a query
+ *
+ * @param what Query code
+ * @private
+ */
+static void query(char what) {
+  Screen *s = &cur->scr;
+  Panel *p = cur->panel;
+  unsigned char pos[2] = {s->x, s->y};
+  bool bin = (cur->proto == PROTO_BINARY);
+  char text[QUERY_MAX];
+  int y, i, len;
+
+  dbg(printf(">> CMD: QUERY\n"));
+  switch (what) {
+    case 'p': // position
+      if (bin) say_frame(cur, 'k', pos, 2);
+      else outq_printf(&cur->out, "ok:%u:%u\n", s->x, s->y);
+      break;
+
+    case 'd': // dim value
+      if (bin) say_frame(cur, 'k', &s->dim, 1);
+      else outq_printf(&cur->out, "ok:%u\n", s->dim);
+      break;
+
+    case 'l': // contents of the screen (single line)
+      for (y = 0; y < s->h; y++)
+        memcpy(text + y * s->w, s->buf + y * SCR_CHARS, s->w);
+      if (bin) say_frame(cur, 'k', text, s->w * s->h);
+      else outq_printf(&cur->out, "ok:%.*s\n", s->w * s->h, text);
+      break;
+
+    case 'i': // IR latency, 'STAGE=HISTOGRAM;...' (see hist_format)
+      for (i = len = 0; (i < LAT_STAGES) && (len < QUERY_MAX); i++) {
+        len += snprintf(text + len, QUERY_MAX - len, i ? ";%s=" : "%s=", stageName[i]);
+        if (len < QUERY_MAX)
+          len += hist_format(&latency[i], text + len, QUERY_MAX - len);
+      }
+      if (len > QUERY_MAX - 1) len = QUERY_MAX - 1;
+      if (bin) say_frame(cur, 'k', text, len);
+      else outq_printf(&cur->out, "ok:%.*s\n", len, text);
       break;
-    }
 
-    if (pfds[PANEL].revents & POLLHUP)
-      die("PANEL EOF");
+    case 'a': // attached panel, 'NAME:COLS:LINES'
+      len = snprintf(text, QUERY_MAX, "%s:%d:%d", p->name, p->disp.lcd.w, p->disp.lcd.h);
+      if (bin) {
+        text[0] = p->disp.lcd.w;
+        text[1] = p->disp.lcd.h;
+        len = strlen(p->name) + 2;
+        memcpy(text + 2, p->name, len - 2);
+        say_frame(cur, 'k', text, len);
+      } else
+        outq_printf(&cur->out, "ok:%.*s\n", len, text);
+      break;
 
-    if (pfds[CLIENT].revents & POLLHUP) {
-      note("Client EOF (1)");
+    case 's': // runtime statistics
+      len = stats_format(p, text, QUERY_MAX, ";");
+      if (len > QUERY_MAX - 1) len = QUERY_MAX - 1;
+      if (bin) say_frame(cur, 'k', text, len);
+      else outq_printf(&cur->out, "ok:%.*s\n", len, text);
       break;
+  }
+}
+
+/** Close the open batch of the current client
+ * All of its commands are applied at once if every one of them was valid,
+ * otherwise none is. Either way there is a single reply, naming the first
+ * bad command on error.
+ *
+ * @private
+ */
+static void batch_close() {
+  Batch *b = cur->batch;
+  char msg[64];
+  int i;
+
+  if (b->fail < 0) {
+    for (i = 0; i < b->count; i++)
+      apply(&b->cmds[i], cur);
+    say_ok();
+  } else {
+    snprintf(msg, sizeof(msg), "%d:%s", b->fail, b->err);
+    stats.errors++;
+    say_error(msg);
+  }
+
+  free(b);
+  cur->batch = NULL;
+}
+
+/** Add a command to the open batch of the current client
+ * Print payloads are copied, the input they came from will not last.
+ * Commands are checked against the window the ones before them set up.
+ *
+ * @param cmd The command
+ * @param err Parse error, NULL if none
+ * @private
+ */
+static void batch_add(const Command *cmd, const char *err) {
+  Batch *b = cur->batch;
+  Command *dst = &b->cmds[b->count];
+
+  if ((err == NULL) && ((cmd->code == 'q') || (cmd->code == 'b') || (cmd->code == 'y') ||
+        (cmd->code == 'a')))
+    err = "not allowed in batch";
+  if (err == NULL)
+    err = check(cmd, cur, &b->scr);
+  if ((err == NULL) && (cmd->len > (CLI_BATCHDATA - b->used)))
+    err = "batch too large";
+
+  if (err != NULL) {
+    if (b->fail < 0) {
+      b->fail = b->count;
+      b->err = err;
+    }
+  } else if (b->fail < 0) {
+    *dst = *cmd;
+    if (cmd->len > 0) {
+      memcpy(b->data + b->used, cmd->data, cmd->len);
+      dst->data = b->data + b->used;
+      b->used += cmd->len;
     }
+    if (cmd->code == 'w')
+      screen_resize(&b->scr, cmd->a, cmd->b, cmd->c, cmd->d);
+  }
+
+  if (++b->count == b->size)
+    batch_close();
+}
+
+/** Execute a parsed command and reply
+ * While a batch is open commands are collected into it instead.
+ *
+ * @param cmd The command
+ * @param err Parse error, NULL if none
+ * @private
+ */
+static void execute(const Command *cmd, const char *err) {
+  stats.cmds++;
+  cur->cmds++;
+
+  if (cur->batch != NULL) {
+    batch_add(cmd, err);
+    return;
+  }
+
+  if ((err != NULL) || ((err = check(cmd, cur, &cur->scr)) != NULL)) {
+    if (err == ERR_UNKNOWN) note(">> Unknown command");
+    stats.errors++;
+    say_error(err);
+    return;
+  }
+
+  if (cmd->code != 'q') reacted();
 
-    if (pfds[PANEL].revents & POLLIN)
-      if (read_packet()) cli_panel_input();
+  switch (cmd->code) {
+    case 'q':
+      query(cmd->a);
+      break;
 
-    if (pfds[CLIENT].revents & POLLIN) {
-      bzero(&bufClient, sizeof(bufClient));
+    case 'y':
+      dbg(printf(">> CMD: SYNC\n"));
+      cur->syncing = true;
+      cur->fenced = false;
+      break;
 
-      if ((count = read(fdClient, &bufClient, sizeof(bufClient))) == 0) {
-        note("Client EOF (2)");
+    case 'b':
+      dbg(printf(">> CMD: BATCH OF %d\n", cmd->a));
+      if ((cur->batch = malloc(sizeof(Batch))) == NULL) {
+        warn("Can't allocate batch");
+        say_error("out of memory");
         break;
-      } else {
-        dbg(printf("CLIENT << %s\n", bufClient));
-        if (bufClient[count-1] == '\n') {
-          line = strtok((char *)&bufClient, "\n");
-          while (line != NULL) {
-            cli_client_input(line);
-            line = strtok(NULL, "\n");
-          }
-        } else
-          fprintf(fClient, "fail:command error\n");
       }
-      fflush(fClient);
-    }
+      cur->batch->size = cmd->a;
+      cur->batch->count = cur->batch->used = 0;
+      cur->batch->fail = -1;
+      cur->batch->scr = cur->scr;
+      break;
+
+    default:
+      apply(cmd, cur);
+      say_ok();
+      break;
   }
 }
+
+/** Flatten the screens of the clients attached to a panel into its display
+ * The focused client is on top, the rest are stacked by z, and by when
+ * they were last raised for equal z.
+ *
+ * @param p The panel
+ * @private
+ */
+static void compose(Panel *p) {
+  Screen *stack[CLI_MAXCLIENTS];
+  Client *order[CLI_MAXCLIENTS];
+  Client *t;
+  int i, j, n;
+
+  for (i = n = 0; i < CLI_MAXCLIENTS; i++)
+    if ((clients[i].fd >= 0) && (clients[i].panel == p)) {
+      t = &clients[i];
+      for (j = n++; (j > 0) && ((order[j-1] == p->focus) ||
+           ((t != p->focus) && ((order[j-1]->z > t->z) ||
+            ((order[j-1]->z == t->z) && (order[j-1]->raised > t->raised))))); j--)
+        order[j] = order[j-1];
+      order[j] = t;
+    }
+
+  for (i = 0; i < n; i++)
+    stack[i] = &order[i]->scr;
+  screen_compose(&p->disp, stack, n, p->cellOwner);
+  for (i = 0; i < SCR_SIZE; i++)
+    if (p->cellOwner[i] >= 0) p->cellOwner[i] = order[p->cellOwner[i]] - clients;
+}
+
+/** Scheduler flow a cell belongs to
+ *
+ * @param p    The panel
+ * @param cell The cell index
+ * @return The flow
+ * @private
+ */
+static int flow_of(Panel *p, int cell) {
+  int i = p->cellOwner[cell];
+
+  return ((i >= 0) && (clients[i].fd >= 0) && (clients[i].panel == p)) ? i : FLOW_NONE;
+}
+
+/** Pick whose changes go to the panel next
+ * A client is interactive for SCH_RECENT after it was sent a key, and so
+ * is a pending dim change.
+ *
+ * @param p     The panel
+ * @param mask  Where to put the cells of the flow picked
+ * @param whole Set if it is the only flow with something to send
+ * @return The flow, -1 if the panel is up to date
+ * @private
+ */
+static int pick(Panel *p, bool *mask, bool *whole) {
+  int cls[FLOW_NONE+1];
+  Client *c;
+  long now;
+  int cell, f, active;
+
+  for (f = 0; f <= FLOW_NONE; f++)
+    cls[f] = -1;
+  if (screen_dim_pending(&p->disp))
+    cls[FLOW_NONE] = SCH_INTERACTIVE;
+
+  now = hist_now();
+  for (cell = 0; cell < SCR_SIZE; cell++) {
+    if (!screen_pending(&p->disp, cell) || (cls[f = flow_of(p, cell)] >= 0)) continue;
+
+    c = &clients[f];
+    if (f == FLOW_NONE)
+      cls[f] = SCH_BACKGROUND;
+    else if ((c->keyAt > 0) && (now - c->keyAt < SCH_RECENT * 1000L))
+      cls[f] = SCH_INTERACTIVE;
+    else
+      cls[f] = (c->weight > 0) ? SCH_NORMAL : SCH_BACKGROUND;
+  }
+
+  if ((f = sched_pick(&p->sched, cls, FLOW_NONE + 1)) < 0) return -1;
+
+  for (cell = active = 0; cell <= FLOW_NONE; cell++)
+    if (cls[cell] >= 0) active++;
+  *whole = (active == 1);
+  for (cell = 0; cell < SCR_SIZE; cell++)
+    mask[cell] = (flow_of(p, cell) == f);
+
+  return f;
+}
+
+/** Check whether the link can take another packet
+ * It is kept SCH_AHEAD packets beyond its window, anything more would
+ * only wait in a queue where it can no longer be overtaken. Without
+ * room, the link thread wakes the loop once there is some.
+ *
+ * @param p The panel
+ * @return True if so
+ * @private
+ */
+static bool link_room(Panel *p) {
+  unsigned long mark = relay_mark(&p->relay);
+  int depth = link_window(&p->relay.link) + SCH_AHEAD;
+
+  return (mark < depth) || relay_reached(&p->relay, mark - depth + 1);
+}
+
+/** Check whether a client has changes its panel is yet to get
+ *
+ * @param i The client slot
+ * @return True if so
+ * @private
+ */
+static bool unsent(int i) {
+  Panel *p = clients[i].panel;
+  int cell;
+
+  for (cell = 0; cell < SCR_SIZE; cell++)
+    if ((flow_of(p, cell) == i) && screen_pending(&p->disp, cell)) return true;
+  return screen_dim_pending(&p->disp);
+}
+
+/** Send a display to its panel as the link takes it
+ * One packet (with the goto leading to it) at a time, for the flow the
+ * scheduler picks. Stops at the first failure, whatever was not sent stays
+ * dirty for the next flush. Clients waiting for a sync get their fence
+ * once all of their changes are sent, whatever others still wait.
+ *
+ * @param p The panel
+ * @return Bytes sent, 0 if the panel was up to date, -1 if deferred
+ * @private
+ */
+static int cli_send(Panel *p) {
+  bool mask[SCR_SIZE], whole, ok;
+  unsigned char *pkt;
+  int len, pos, total, flow, i;
+
+  total = 0;
+  ok = true;
+  while (ok && (p->deferred = ((flow = pick(p, mask, &whole)) >= 0)) && link_room(p)) {
+    if ((len = screen_plan(&p->disp, bufPlan, sizeof(bufPlan), whole ? NULL : mask)) <= 0) {
+      p->deferred = false;
+      break;
+    }
+
+    for (pos = 0; pos < len; ) {
+      pkt = bufPlan + pos;
+      pos += pkt[0] + 1;
+      screen_sent(&p->disp, pkt);
+      if (!relay_send(&p->relay, pkt)) {
+        screen_lost(&p->disp, pkt);
+        ok = false;
+        break;
+      }
+      if (pkt[1] != 'g') break;
+    }
+    sched_charge(&p->sched, flow, pos);
+    total += pos;
+  }
+  if (total > 0) trace_add(TRC_FLUSH, p - panels, &total, sizeof(total));
+
+  if (p->reactAt != 0) {
+    if (total > 0) {
+      hist_add(&latency[LAT_FLUSH], hist_now() - p->reactAt);
+      hist_add(&latency[LAT_TOTAL], hist_now() - p->reactFrom);
+      p->reactAt = 0;
+    } else if (!p->deferred)
+      p->reactAt = 0;
+  }
+
+  for (i = 0; i < CLI_MAXCLIENTS; i++)
+    if ((clients[i].fd >= 0) && (clients[i].panel == p) &&
+        clients[i].syncing && !clients[i].fenced && !unsent(i)) {
+      clients[i].fence = relay_mark(&p->relay);
+      clients[i].fenced = true;
+    }
+
+  return (p->deferred && (total == 0)) ? -1 : total;
+}
+
+/** Bring the panels up to date with the client screens
+ * While a link is busy changes keep accumulating in the display, and go
+ * out as it takes more (see cli_loop()).
+ *
+ * @return Bytes sent, 0 if every panel was up to date, -1 if deferred
+ * @private
+ */
+static int cli_flush() {
+  int i, len, total;
+  bool waiting;
+
+  total = 0;
+  waiting = false;
+  for (i = 0; i < numPanels; i++) {
+    compose(&panels[i]);
+    if ((len = cli_send(&panels[i])) < 0) waiting = true;
+    else total += len;
+  }
+
+  return (waiting && (total == 0)) ? -1 : total;
+}
+
+/** Arm or disarm the refresh timer
+ *
+ * @param on True to start ticking
+ * @private
+ */
+static void tick_arm(bool on) {
+  struct itimerspec its;
+
+  bzero(&its, sizeof(its));
+  if (on) {
+    its.it_interval.tv_sec = (rate == 1) ? 1 : 0;
+    its.it_interval.tv_nsec = (rate == 1) ? 0 : 1000000000L / rate;
+    its.it_value = its.it_interval;
+  }
+
+  IO_CALL();
+  if (timerfd_settime(fdTick, 0, &its, NULL) != 0)
+    warn("Can't set refresh timer");
+  ticking = on;
+}
+
+/** Handle a refresh tick
+ * Sends what changed since the last tick. The timer is stopped once
+ * there is nothing left to send, the next change will start it again.
+ *
+ * @private
+ */
+static void tick() {
+  uint64_t expirations;
+
+  IO_CALL();
+  if (read(fdTick, &expirations, sizeof(expirations)) != sizeof(expirations))
+    errno = 0;
+
+  if (cli_flush() == 0)
+    tick_arm(false);
+}
+
+/** Schedule the panel update after a change
+ *
+ * @private
+ */
+static void changed() {
+  if (fdTick < 0)
+    cli_flush();
+  else if (!ticking)
+    tick_arm(true);
+}
+
+// client connections
+
+/** Register an epoll interest
+ *
+ * @param fd The fd to watch for input
+ * @param id The id to report events with
+ * @return True if registered
+ * @private
+ */
+static bool watch(int fd, uint32_t id) {
+  struct epoll_event ev;
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = id;
+  return epoll_ctl(fdEpoll, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+/** Change what a watched fd is watched for
+ *
+ * @param fd  The fd
+ * @param id  The id it was registered with
+ * @param in  True to watch for input
+ * @param out True to watch for writability
+ * @return True if changed
+ * @private
+ */
+static bool rewatch(int fd, uint32_t id, bool in, bool out) {
+  struct epoll_event ev;
+
+  ev.events = (in ? EPOLLIN : 0) | (out ? EPOLLOUT : 0);
+  ev.data.u32 = id;
+  IO_CALL();
+  return epoll_ctl(fdEpoll, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+/** Post a read for a client
+ * Goes to the buffer of the current generation, so a stale read can not
+ * land in it.
+ *
+ * @param c The client
+ * @private
+ */
+static void ring_read(Client *c) {
+  int i = c - clients;
+
+  ioring_read(c->fd, ringIn[i][c->gen & 1], CLI_CLIENTBUF, TAG(TAG_READ, ID_CLIENT + i, c->gen));
+}
+
+/** Post a write of everything queued for an FD
+ * The bytes are copied, so the queue can change while the write is in
+ * flight.
+ *
+ * @param fd  The FD
+ * @param id  Its epoll id
+ * @param gen Client generation, 0 if not a client
+ * @param q   The queue
+ * @return True if posted
+ * @private
+ */
+static bool ring_send(int fd, uint32_t id, uint32_t gen, const OutQ *q) {
+  Send *snd;
+
+  if ((snd = malloc(sizeof(Send) + q->count)) == NULL) {
+    warn("Can't allocate write buffer");
+    return false;
+  }
+  snd->id = id;
+  snd->gen = gen;
+  ioring_write(fd, snd->data, outq_peek(q, snd->data, q->count), (uint64_t)(uintptr_t)snd);
+  return true;
+}
+
+/** Release a client slot
+ *
+ * @param c The client
+ * @private
+ */
+static void client_free(Client *c) {
+  free(c->in);
+  free(c->batch);
+  c->in = NULL;
+  c->batch = NULL;
+  outq_free(&c->out);
+  c->writing = false;
+  c->fd = -1;
+}
+
+/** Accept all pending connections on a listening socket
+ *
+ * @param fd The listening socket
+ * @private
+ */
+static void client_accept(int fd) {
+  struct sockaddr_storage ss;
+  struct sockaddr_in *sin;
+  socklen_t slen;
+  int fdNew, i;
+
+  while (true) {
+    slen = sizeof(ss);
+    IO_CALL();
+    // io_uring returns EAGAIN on non-blocking sockets instead of waiting
+    if ((fdNew = accept4(fd, (struct sockaddr *)&ss, &slen,
+            ring ? SOCK_CLOEXEC : SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+        warn("Error on accept");
+      errno = 0;
+      return;
+    }
+
+    for (i = 0; i < CLI_MAXCLIENTS; i++)
+      if (clients[i].fd < 0) break;
+
+    if (i == CLI_MAXCLIENTS) {
+      note("Too many clients, refusing connection");
+      close(fdNew);
+      continue;
+    }
+
+    if ((clients[i].in = malloc(CLI_CLIENTBUF)) == NULL) {
+      warn("Can't allocate client buffer");
+      close(fdNew);
+      continue;
+    }
+    clients[i].inSize = CLI_CLIENTBUF;
+    clients[i].inHead = clients[i].inCount = clients[i].inScan = 0;
+    clients[i].inSkip = false;
+    clients[i].proto = PROTO_UNKNOWN;
+    clients[i].panel = NULL;
+    clients[i].z = 0;
+    clients[i].raised = ++raiseCount;
+    clients[i].subscribed = false;
+    clients[i].keyAt = 0;
+    clients[i].weight = 1;
+    attach(&clients[i], &panels[0]);
+    clients[i].cmds = 0;
+    clients[i].syncing = clients[i].held = false;
+    clients[i].since = hist_now();
+    clients[i].gen++;
+    outq_init(&clients[i].out, fdNew);
+
+    if (!ring && !watch(fdNew, ID_CLIENT + i)) {
+      warn("Can't watch CLIENT FD");
+      close(fdNew);
+      client_free(&clients[i]);
+      continue;
+    }
+
+    clients[i].fd = fdNew;
+    if (ring) ring_read(&clients[i]);
+    trace_add(TRC_CONNECT, i, NULL, 0);
+    if (ss.ss_family == AF_INET) {
+      sin = (struct sockaddr_in *)&ss;
+      note("Client %d from: %s:%d", i, inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+    } else
+      note("Client %d connected", i);
+  }
+}
+
+/** Disconnect a client and free its slot
+ *
+ * @param c The client
+ * @private
+ */
+static void client_close(Client *c) {
+  if (ring)
+    ioring_cancel(TAG(TAG_READ, ID_CLIENT + (c - clients), c->gen));
+  else {
+    epoll_ctl(fdEpoll, EPOLL_CTL_DEL, c->fd, NULL);
+    outq_flush(&c->out);
+  }
+  close(c->fd);
+  trace_add(TRC_DISCONNECT, c - clients, NULL, 0);
+  note("Client %d disconnected", (int)(c - clients));
+  if (c->panel->focus == c) c->panel->focus = NULL;
+  client_free(c);
+  if (running) changed();
+}
+
+/** Grow the input ring of a client
+ * Keeps the contents, unwrapped to the start of the new ring.
+ *
+ * @param c The client
+ * @return False if the ring is already at CLI_MAXLINE
+ * @private
+ */
+static bool ring_grow(Client *c) {
+  char *in;
+  int size, first;
+
+  if (c->inSize >= CLI_MAXLINE) return false;
+  size = c->inSize * 2;
+  if (size > CLI_MAXLINE) size = CLI_MAXLINE;
+
+  if ((in = malloc(size)) == NULL) {
+    warn("Can't grow client buffer");
+    return false;
+  }
+
+  first = c->inSize - c->inHead;
+  if (first > c->inCount) first = c->inCount;
+  memcpy(in, c->in + c->inHead, first);
+  memcpy(in + first, c->in, c->inCount - first);
+
+  free(c->in);
+  c->in = in;
+  c->inSize = size;
+  c->inHead = 0;
+  return true;
+}
+
+/** Take the next complete line out of a client's input ring
+ * The newline (and a carriage return before it) is stripped.
+ *
+ * @param c The client
+ * @return The line (null-terminated), NULL if there is no complete line
+ * @private
+ */
+static char *ring_line(Client *c) {
+  char *line;
+  int i, n;
+
+  for (n = c->inScan; n < c->inCount; n++)
+    if (c->in[(c->inHead + n) % c->inSize] == '\n') break;
+
+  if (n == c->inCount) {
+    c->inScan = n;
+    return NULL;
+  }
+
+  if (c->inHead + n < c->inSize)
+    line = c->in + c->inHead;
+  else {
+    for (i = 0; i < n; i++)
+      bufLine[i] = c->in[(c->inHead + i) % c->inSize];
+    line = bufLine;
+  }
+  line[n] = 0;
+  if ((n > 0) && (line[n-1] == '\r')) line[n-1] = 0;
+
+  c->inHead = (c->inHead + n + 1) % c->inSize;
+  c->inCount -= n + 1;
+  c->inScan = 0;
+
+  return line;
+}
+
+/** Take the next complete frame out of a client's input ring
+ *
+ * @param c   The client
+ * @param len Where to put the payload length
+ * @return The payload, NULL if there is no complete frame
+ * @private
+ */
+static const unsigned char *ring_frame(Client *c, int *len) {
+  const unsigned char *frame;
+  int i, n;
+
+  if (c->inCount < 1) return NULL;
+  n = (unsigned char)c->in[c->inHead];
+  if (c->inCount < n + 1) return NULL;
+
+  if (c->inHead + n < c->inSize)
+    frame = (unsigned char *)c->in + (c->inHead + 1) % c->inSize;
+  else {
+    for (i = 0; i < n; i++)
+      bufLine[i] = c->in[(c->inHead + 1 + i) % c->inSize];
+    frame = (unsigned char *)bufLine;
+  }
+
+  c->inHead = (c->inHead + n + 1) % c->inSize;
+  c->inCount -= n + 1;
+  *len = n;
+
+  return frame;
+}
+
+/** Stop or resume reading from a client
+ * A client waiting for a sync is not read from, so what it sends
+ * meanwhile stays in its socket, and it blocks, instead of piling up in
+ * the input ring.
+ *
+ * @param c    The client
+ * @param held True to stop reading
+ * @private
+ */
+static void client_hold(Client *c, bool held) {
+  c->held = held;
+  if (ring) {
+    if (!held) ring_read(c); // a held client has no read in flight
+  } else if (!rewatch(c->fd, ID_CLIENT + (c - clients), !held, c->writing))
+    warn("Can't watch CLIENT FD");
+}
+
+/** Process the input buffered for a client
+ * Stops at a sync, the rest is processed once the panel caught up.
+ *
+ * @param c The client
+ * @private
+ */
+static void client_process(Client *c) {
+  const unsigned char *frame;
+  const char *err;
+  Command cmd;
+  char *line;
+  int len;
+
+  cur = c;
+  if ((c->proto == PROTO_UNKNOWN) && (c->inCount > 0)) {
+    if ((unsigned char)c->in[c->inHead] == CLI_BINMAGIC) {
+      c->inHead = (c->inHead + 1) % c->inSize;
+      c->inCount--;
+      c->proto = PROTO_BINARY;
+      say_ok();
+    } else
+      c->proto = PROTO_ASCII;
+  }
+
+  if (c->proto == PROTO_BINARY)
+    while (!c->syncing && ((frame = ring_frame(c, &len)) != NULL)) {
+      if (len == 0) continue;
+      trace_add(TRC_COMMAND, c - clients, frame, len);
+      err = parse_frame(frame, len, &cmd);
+      execute(&cmd, err);
+    }
+  else
+    while (!c->syncing && ((line = ring_line(c)) != NULL)) {
+      if (c->inSkip) {
+        c->inSkip = false;
+        continue;
+      }
+      if (line[0] == 0) continue;
+      dbg(printf("CLI << %s\n", line));
+      trace_add(TRC_COMMAND, c - clients, line, strlen(line));
+      err = parse_line(line, &cmd);
+      execute(&cmd, err);
+    }
+  cur = NULL;
+
+  if (c->held != c->syncing) client_hold(c, c->syncing);
+  if (c->syncing) cli_flush();
+  else changed();
+}
+
+/** Find room for input in a client's input ring
+ * Grows the ring when full. A line that does not fit even then is failed
+ * and skipped. Only a partial line can fill the ring, as nothing is read
+ * while complete ones wait for a sync (see client_hold()), so a binary
+ * frame always fits. Should the ring not grow for a binary client anyway
+ * it has to go, as there is no skipping to the next frame.
+ *
+ * @param c    The client
+ * @param room Where to put the number of bytes available
+ * @return Where the input goes, NULL if the client has to go
+ * @private
+ */
+static char *client_room(Client *c, int *room) {
+  int tail;
+
+  if ((c->inCount == c->inSize) && !ring_grow(c)) {
+    if (c->proto == PROTO_BINARY) {
+      note("Input of client %d does not fit, dropping it", (int)(c - clients));
+      return NULL;
+    }
+    note("Line too long from client %d", (int)(c - clients));
+    outq_printf(&c->out, "fail:line too long\n");
+    c->inHead = c->inCount = c->inScan = 0;
+    c->inSkip = true;
+  }
+
+  tail = (c->inHead + c->inCount) % c->inSize;
+  *room = (tail >= c->inHead) ? c->inSize - tail : c->inHead - tail;
+  if (*room > c->inSize - c->inCount) *room = c->inSize - c->inCount;
+  return c->in + tail;
+}
+
+/** Read and process input from a client
+ * Reads whatever fits into the client's input ring and processes every
+ * complete line (or frame, for binary clients) in it. A partial line
+ * stays in the ring until the rest arrives.
+ *
+ * The protocol is decided by the first byte a client sends: CLI_BINMAGIC
+ * switches the connection to binary frames (and is acked with an ok
+ * frame), anything else is taken as the start of an ASCII command.
+ *
+ * @param c The client
+ * @return False if the client went away
+ * @private
+ */
+static bool client_input(Client *c) {
+  char *buf;
+  int room, count;
+
+  if ((buf = client_room(c, &room)) == NULL) return false;
+  IO_CALL();
+  if ((count = read(c->fd, buf, room)) <= 0) {
+    if ((count < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+      errno = 0;
+      return true;
+    }
+    note("Client EOF");
+    return false;
+  }
+  c->inCount += count;
+
+  client_process(c);
+  return true;
+}
+
+/** Write out what is queued for a client
+ * Whatever the socket does not take waits for it to become writable.
+ *
+ * @param c The client
+ * @return False if the client has to go (write error, or too slow)
+ * @private
+ */
+static bool client_flush(Client *c) {
+  int left;
+
+  if ((left = outq_flush(&c->out)) < 0) {
+    note("Write to client %d failed", (int)(c - clients));
+    return false;
+  }
+  if (c->out.full) {
+    note("Client %d is not reading, dropping it", (int)(c - clients));
+    return false;
+  }
+
+  if ((left > 0) != c->writing) {
+    if (!rewatch(c->fd, ID_CLIENT + (c - clients), !c->held, left > 0)) {
+      warn("Can't watch CLIENT FD");
+      return false;
+    }
+    c->writing = left > 0;
+  }
+
+  return true;
+}
+
+/** Process input read for a client by io_uring
+ *
+ * @param c    The client
+ * @param data The input
+ * @param len  Its length
+ * @return False if the client has to go
+ * @private
+ */
+static bool client_feed(Client *c, const char *data, int len) {
+  char *buf;
+  int room;
+
+  while (len > 0) {
+    if ((buf = client_room(c, &room)) == NULL) return false;
+    if (room > len) room = len;
+    memcpy(buf, data, room);
+    c->inCount += room;
+    data += room;
+    len -= room;
+    client_process(c);
+  }
+
+  return true;
+}
+
+/** Answer the clients whose sync the panel caught up with
+ *
+ * @private
+ */
+static void sync_check() {
+  Client *c;
+  int i;
+
+  for (i = 0; i < CLI_MAXCLIENTS; i++) {
+    c = &clients[i];
+    if ((c->fd < 0) || !c->syncing || !c->fenced || !relay_reached(&c->panel->relay, c->fence))
+      continue;
+
+    c->syncing = false;
+    cur = c;
+    say_ok();
+    client_process(c);
+  }
+}
+
+// event loops
+
+/** Relay callback for a panel back after a hang-up
+ * What it shows is not known any more, so all of it is sent again.
+ *
+ * @param ctx The panel
+ * @private
+ */
+static void cli_panel_reset(void *ctx) {
+  Panel *p = ctx;
+
+  note("Panel %s back, repainting", p->name);
+  screen_invalidate(&p->disp);
+  p->irpkt.count = 0;
+  p->clock.spans = 0;
+  changed();
+}
+
+/** Handle the events from a panel's link thread
+ *
+ * @param p The panel
+ * @private
+ */
+static void panel_events(Panel *p) {
+  if (!relay_events(&p->relay)) {
+    note("Panel %s went away", p->name);
+    die("PANEL EOF");
+  }
+}
+
+/** Wait for and handle epoll events
+ *
+ * @return False on a fatal error
+ * @private
+ */
+static bool wait_epoll() {
+  struct epoll_event evs[CLI_MAXEVENTS];
+  unsigned char wakes;
+  Client *c;
+  uint32_t id;
+  int count, i;
+
+  // everything queued since the last wait goes out in one write each
+  for (i = 0; i < CLI_MAXCLIENTS; i++) {
+    c = &clients[i];
+    if ((c->fd >= 0) && (c->out.full || (!c->writing && (c->out.count > 0))) &&
+        !client_flush(c))
+      client_close(c);
+  }
+
+  IO_CALL();
+  if ((count = epoll_wait(fdEpoll, evs, CLI_MAXEVENTS, -1)) < 0) {
+    if (errno == EINTR) {
+      errno = 0;
+      return true;
+    }
+    warn("Error on epoll_wait");
+    return false;
+  }
+
+  wakes = count;
+  trace_add(TRC_WAKE, TRC_NOBODY, &wakes, 1);
+
+  for (i = 0; i < count; i++) {
+    id = evs[i].data.u32;
+
+    if (id == ID_TICK)
+      tick();
+    else if (id < ID_LISTEN)
+      panel_events(&panels[id - ID_PANEL]);
+    else if (id < ID_CLIENT)
+      client_accept(fdListen[id - ID_LISTEN]);
+    else {
+      c = &clients[id - ID_CLIENT];
+      if (c->fd < 0) continue;
+
+      if ((evs[i].events & EPOLLOUT) && !client_flush(c))
+        client_close(c);
+      else if ((evs[i].events & EPOLLIN) && !c->held) {
+        if (!client_input(c)) client_close(c);
+      } else if (evs[i].events & (EPOLLHUP | EPOLLERR))
+        client_close(c);
+    }
+  }
+
+  return true;
+}
+
+/** Handle a finished io_uring write
+ *
+ * @param snd The write
+ * @param res Bytes written, -errno on failure
+ * @private
+ */
+static void ring_sent(Send *snd, int res) {
+  Client *c = &clients[snd->id - ID_CLIENT];
+
+  if ((c->fd >= 0) && (c->gen == snd->gen)) {
+    c->writing = false;
+    if (res >= 0)
+      outq_drop(&c->out, res);
+    else {
+      note("Write to client %d failed", (int)(c - clients));
+      client_close(c);
+    }
+  }
+
+  free(snd);
+}
+
+/** Handle a finished io_uring read
+ *
+ * @param id  Epoll id of the FD
+ * @param gen Client generation
+ * @param res Bytes read, -errno on failure
+ * @private
+ */
+static void ring_received(uint32_t id, uint32_t gen, int res) {
+  Client *c = &clients[id - ID_CLIENT];
+
+  if ((c->fd < 0) || (c->gen != gen)) return; // for a closed connection
+
+  if ((res == -EINTR) || (res == -EAGAIN))
+    ;
+  else if (res <= 0) {
+    note("Client EOF");
+    client_close(c);
+    return;
+  } else if (!client_feed(c, ringIn[id - ID_CLIENT][gen & 1], res)) {
+    client_close(c);
+    return;
+  }
+
+  if (!c->held) ring_read(c);
+}
+
+/** Submit the queued I/O, then wait for and handle io_uring completions
+ *
+ * @return False on a fatal error
+ * @private
+ */
+static bool wait_ring() {
+  unsigned char wakes;
+  IoEvent ev;
+  Client *c;
+  uint32_t id;
+  int i;
+
+  // everything queued since the last wait goes in with it
+  for (i = 0; i < CLI_MAXCLIENTS; i++) {
+    c = &clients[i];
+    if (c->fd < 0) continue;
+    if (c->out.full) {
+      note("Client %d is not reading, dropping it", i);
+      client_close(c);
+    } else if (!c->writing && (c->out.count > 0))
+      c->writing = ring_send(c->fd, ID_CLIENT + i, c->gen, &c->out);
+  }
+
+  if (ioring_wait(-1) < 0) {
+    warn("Error waiting on io_uring");
+    return false;
+  }
+
+  for (wakes = 0; ioring_next(&ev); wakes++) {
+    if (!(ev.tag & 1)) {
+      ring_sent((Send *)(uintptr_t)ev.tag, ev.res);
+      continue;
+    }
+
+    id = (ev.tag >> 2) & 0x3fffffff;
+    if ((ev.tag & 3) == TAG_READ) {
+      ring_received(id, ev.tag >> 32, ev.res);
+      continue;
+    }
+
+    if (id == ID_TICK)
+      tick();
+    else if (id < ID_LISTEN)
+      panel_events(&panels[id - ID_PANEL]);
+    else
+      client_accept(fdListen[id - ID_LISTEN]);
+    if (!ev.more)
+      ioring_poll(id == ID_TICK ? fdTick : id < ID_LISTEN ?
+          relay_fd(&panels[id - ID_PANEL].relay) : fdListen[id - ID_LISTEN], ev.tag);
+  }
+  trace_add(TRC_WAKE, TRC_NOBODY, &wakes, 1);
+
+  return true;
+}
+
+// Public routines
+
+/** Setup the CLI library
+ * With useRing the I/O is done with io_uring if the kernel has it.
+ * Panels are added with cli_panel() afterwards.
+ */
+void cli_setup() {
+  int i;
+
+  if ((fdEpoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    die("Can't create epoll instance");
+
+  fdTick = -1;
+  ticking = false;
+  if (rate > 0)
+    if ((fdTick = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+      die("Can't create refresh timer");
+
+  for (i = 0; i < CLI_MAXCLIENTS; i++)
+    client_free(&clients[i]);
+  numListen = numPanels = 0;
+  stats.started = hist_now();
+
+  if ((ring = useRing && ioring_setup())) {
+    if (fdTick >= 0)
+      ioring_poll(fdTick, TAG(TAG_POLL, ID_TICK, 0));
+    note("Using io_uring");
+    return;
+  }
+  if (useRing)
+    note("No io_uring, using epoll");
+
+  if ((fdTick >= 0) && !watch(fdTick, ID_TICK))
+    die("Can't watch refresh timer");
+}
+
+/** Add a panel
+ * The device is opened, the link window negotiated and the link thread
+ * started right away. The first panel added is the one clients start
+ * out on.
+ *
+ * @param name   Name clients attach by (up to CLI_MAXNAME chars)
+ * @param device Path to the panel device (has to stay around)
+ * @param cfg    Its serial config
+ * @param cols   Panel width in chars (up to SCR_CHARS)
+ * @param lines  Panel height in lines (up to SCR_LINES)
+ */
+void cli_panel(const char *name, const char *device, const SerialConfig *cfg, int cols, int lines) {
+  Panel *p;
+  int id;
+
+  if (numPanels >= CLI_MAXPANELS)
+    die("Too many panels");
+  if ((strlen(name) < 1) || (strlen(name) > CLI_MAXNAME) || strchr(name, ':'))
+    die("Bad panel name");
+  if (panel_find(name, strlen(name)) != NULL)
+    die("Duplicate panel name");
+  if ((cols < 1) || (cols > SCR_CHARS) || (lines < 1) || (lines > SCR_LINES))
+    die("Bad panel geometry");
+
+  p = &panels[numPanels];
+  id = ID_PANEL + numPanels;
+  strcpy(p->name, name);
+  screen_init(&p->disp, cols, lines);
+  sched_reset(&p->sched, FLOW_NONE, 0);
+  p->deferred = false;
+  p->focus = NULL;
+  p->irpkt.count = 0;
+  p->clock.spans = 0;
+  p->reactAt = 0;
+  note("Panel %s: %dx%d", name, cols, lines);
+  relay_setup(&p->relay, device, cfg, numPanels, cli_panel_input, cli_panel_lost,
+      cli_panel_reset, p);
+
+  if (ring)
+    ioring_poll(relay_fd(&p->relay), TAG(TAG_POLL, id, 0));
+  else if (!watch(relay_fd(&p->relay), id))
+    die("Can't watch relay FD");
+  numPanels++;
+}
+
+/** Add a listening socket
+ * The socket should be non-blocking and already listening.
+ *
+ * @param fd The listening socket
+ */
+void cli_listen(int fd) {
+  if (numListen >= CLI_MAXLISTEN)
+    die("Too many listening sockets");
+  if (ring)
+    ioring_poll(fd, TAG(TAG_POLL, ID_LISTEN + numListen, 0));
+  else if (!watch(fd, ID_LISTEN + numListen))
+    die("Can't watch listening socket");
+  fdListen[numListen++] = fd;
+}
+
+/** Main processing loop
+ * Requires cli_setup(), at least one cli_panel() and at least one
+ * cli_listen(). Runs until running is cleared.
+ *
+ * @see running
+ */
+void cli_loop() {
+  int i;
+
+  cli_flush();
+
+  while (running) {
+    if (dumpStats) {
+      dumpStats = false;
+      stats_dump();
+    }
+    if (trace_due() || dumpTrace) {
+      dumpTrace = false;
+      trace_dump(tracePath);
+    }
+
+    if (!(ring ? wait_ring() : wait_epoll()))
+      break;
+
+    for (i = 0; i < numPanels; i++)
+      if (panels[i].deferred && link_room(&panels[i]))
+        cli_send(&panels[i]);
+    sync_check();
+  }
+}
+
+/** Disconnect all clients and release resources
+ */
+void cli_shutdown() {
+  int i;
+
+  for (i = 0; i < CLI_MAXCLIENTS; i++)
+    if (clients[i].fd >= 0)
+      client_close(&clients[i]);
+  ioring_shutdown();
+  for (i = 0; i < numPanels; i++)
+    relay_shutdown(&panels[i].relay);
+  if (fdTick >= 0)
+    close(fdTick);
+  close(fdEpoll);
+}
@@ -7,16 +7,31 @@
 #ifndef IRPD_CLI
 #define IRPD_CLI 1
 
+#include "screen.h"
+#include "serial.h"
+
 // Configurable defines
 
-#define CLI_PANELBUF  24    //!< This is used for I/O with panel
-#define CLI_CLIENTBUF 1024  //!< Maximum length for input line  
-#define CLI_LCDLINES  4     //!< LCD height in lines
-#define CLI_LCDCHARS  20    //!< LCD width in chars/bytes
+#define CLI_CLIENTBUF 1024  //!< Initial size of a client input buffer
+#define CLI_MAXLINE   65536 //!< Maximum length for input line (and buffer)
+#define CLI_BINMAGIC  0xff  //!< First byte sent by binary protocol clients
+#define CLI_MAXBATCH  64    //!< Most commands in a batch
+#define CLI_BATCHDATA (CLI_MAXBATCH*SCR_SIZE) //!< Most print payload bytes in a batch (every command a full print)
+#define CLI_MAXCLIENTS  16  //!< Maximum number of concurrent clients
+#define CLI_MAXLISTEN   2   //!< Maximum number of listening sockets
+#define CLI_MAXPANELS   8   //!< Maximum number of panels
+#define CLI_MAXNAME     15  //!< Longest panel name
+#define CLI_BACKLOG     8   //!< Listen queue length
+#define CLI_MAXEVENTS   16  //!< Events fetched per epoll_wait call
+#define CLI_FWTICK    256   //!< Firmware IR stamp tick in us
+#define CLI_CLOCKSPAN 60    //!< Seconds the panel clock offset is trusted
 
 // Public routines
 
 void cli_setup(void);
+void cli_panel(const char *name, const char *device, const SerialConfig *cfg, int cols, int lines);
+void cli_listen(int fd);
 void cli_loop(void);
+void cli_shutdown(void);
 
 #endif
@@ -21,20 +21,17 @@
 
 bool cmnStamp = false;
 
-// Private variables
-
-static char timestamp[128];
-
 // Private routines
 
 void stamp(FILE *out) {
-  struct tm *tms;
+  char timestamp[128];
+  struct tm tms;
   time_t t;
 
   if (cmnStamp) {
     t = time(NULL);
-    if (((tms = localtime(&t)) != NULL) &&
-        (strftime(timestamp, sizeof(timestamp), CMN_TIMESTAMP, tms) > 1))
+    if ((localtime_r(&t, &tms) != NULL) &&
+        (strftime(timestamp, sizeof(timestamp), CMN_TIMESTAMP, &tms) > 1))
       fprintf(out, "%s ", timestamp);
   }
 }
@@ -0,0 +1,118 @@
+/** @file
+ * Latency histogram library
+ *
+ * Keeps samples (in microseconds) in log2 buckets, so recording one costs
+ * next to nothing and a histogram has a fixed size no matter how long the
+ * daemon runs. Bucket 0 holds samples below 2 us, bucket n the ones from
+ * 2^n us up to 2^(n+1) us.
+ *
+ * A histogram is written by one thread, but may be read by any (see
+ * STAT_ADD()).
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <time.h>
+
+#include "hist.h"
+
+// Public routines
+
+/** Monotonic time in microseconds
+ *
+ * @return The time
+ */
+long hist_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/** Record a sample
+ * Negative samples are counted as zero.
+ *
+ * @param h  The histogram
+ * @param us The sample in us
+ */
+void hist_add(Hist *h, long us) {
+  int b;
+
+  if (us < 0) us = 0;
+  for (b = 0; (b < HIST_BUCKETS - 1) && (us >> (b + 1)); b++);
+
+  if ((h->count == 0) || (us < h->min)) STAT_SET(h->min, us);
+  if ((h->count == 0) || (us > h->max)) STAT_SET(h->max, us);
+  STAT_ADD(h->bucket[b], 1);
+  STAT_ADD(h->sum, us);
+  STAT_ADD(h->count, 1);
+}
+
+/** Mean of the samples
+ *
+ * @param h The histogram
+ * @return The mean in us, 0 if there are no samples
+ */
+long hist_mean(const Hist *h) {
+  unsigned long count = STAT_GET(h->count);
+
+  return count ? STAT_GET(h->sum) / count : 0;
+}
+
+/** Estimate a quantile
+ * The quantile is placed linearly within the bucket it falls in, with
+ * the bucket's range clamped to the smallest and the largest sample.
+ *
+ * @param h        The histogram
+ * @param permille The quantile, in 1/1000
+ * @return The estimate in us, 0 if there are no samples
+ */
+long hist_quantile(const Hist *h, int permille) {
+  unsigned long want, seen, in, count;
+  long low, high, min, max;
+  int b;
+
+  if ((count = STAT_GET(h->count)) == 0) return 0;
+
+  want = (count * permille + 999) / 1000;
+  if (want < 1) want = 1;
+  for (b = seen = in = 0; b < HIST_BUCKETS - 1; b++)
+    if ((seen += (in = STAT_GET(h->bucket[b]))) >= want) break;
+  if (b == HIST_BUCKETS - 1)
+    seen += (in = STAT_GET(h->bucket[b]));
+
+  min = STAT_GET(h->min);
+  max = STAT_GET(h->max);
+  low = b ? (1L << b) : 0;
+  high = (b < HIST_BUCKETS - 1) ? (2L << b) - 1 : max;
+  if (low < min) low = min;
+  if (high > max) high = max;
+  if ((in == 0) || (high <= low)) return high;
+
+  // the want-th sample of the bucket, with the bucket's samples spread evenly
+  return low + (high - low) * (long)(want - (seen - in)) / (long)in;
+}
+
+/** Format a histogram as text
+ * The format is 'COUNT:MIN:MAX:B0,B1,...', with trailing empty buckets
+ * left out.
+ *
+ * @param h    The histogram
+ * @param out  Where to put the text
+ * @param size Space available in out
+ * @return Length of the text (see snprintf)
+ */
+int hist_format(const Hist *h, char *out, int size) {
+  int pos, last, b;
+
+  for (last = HIST_BUCKETS - 1; (last > 0) && (STAT_GET(h->bucket[last]) == 0); last--);
+
+  pos = snprintf(out, size, "%lu:%ld:%ld:", STAT_GET(h->count), STAT_GET(h->min), STAT_GET(h->max));
+  for (b = 0; (b <= last) && (pos < size); b++)
+    pos += snprintf(out + pos, size - pos, b ? ",%lu" : "%lu", STAT_GET(h->bucket[b]));
+
+  return pos;
+}
@@ -0,0 +1,39 @@
+/** @file
+ * Latency histogram library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_HIST
+#define IRPD_HIST 1
+
+// Configurable defines
+
+#define HIST_BUCKETS  32    //!< Log2 buckets, the last one takes the rest
+
+// Public defines
+
+// statistics are kept by one thread and read by any, with relaxed atomics
+#define STAT_ADD(x, n) __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED) //!< Add to a statistic
+#define STAT_SET(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)   //!< Set a statistic
+#define STAT_GET(x)    __atomic_load_n(&(x), __ATOMIC_RELAXED)         //!< Read a statistic
+
+// Public types
+
+typedef struct {
+  unsigned long count;                  //!< Number of samples
+  long min;                             //!< Smallest sample in us
+  long max;                             //!< Largest sample in us
+  unsigned long sum;                    //!< All samples in us
+  unsigned long bucket[HIST_BUCKETS];   //!< Samples by log2 of us
+} Hist;
+
+// Public routines
+
+long hist_now(void);
+void hist_add(Hist *h, long us);
+long hist_mean(const Hist *h);
+long hist_quantile(const Hist *h, int permille);
+int hist_format(const Hist *h, char *out, int size);
+
+#endif
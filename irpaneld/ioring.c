@@ -0,0 +1,272 @@
+/** @file
+ * io_uring library
+ *
+ * A minimal io_uring driver on the raw system calls (no liburing needed).
+ * Requests are only queued by the routines here, and ioring_wait() submits
+ * everything queued since the last wait and waits for completions in a
+ * single io_uring_enter(), so a loop iteration costs one system call no
+ * matter how many reads and writes it starts.
+ *
+ * Every request carries a caller chosen tag, which comes back with its
+ * completion. Tag 0 is used internally, its completions are never
+ * reported.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "ioring.h"
+#include "irpaneld.h"
+
+// Internal types and variables
+
+static int fdRing = -1;               //!< The ring, -1 if not set up
+static void *sqMap, *cqMap;           //!< Mapped ring areas
+static size_t sqSize, cqSize;         //!< Their sizes
+static struct io_uring_sqe *sqes;     //!< Submission entries
+static unsigned *sqTail, *sqMask, *sqArray;
+static unsigned *cqHead, *cqTail, *cqMask;
+static struct io_uring_cqe *cqes;     //!< Completion entries
+static unsigned queued;               //!< Entries queued since the last enter
+
+// Internal routines
+
+/** Enter the ring
+ *
+ * @param submit Entries to submit
+ * @param wait   Completions to wait for
+ * @param ts     Longest wait, NULL for none
+ * @return As io_uring_enter
+ * @private
+ */
+static int enter(unsigned submit, unsigned wait, struct timespec *ts) {
+  struct io_uring_getevents_arg arg;
+  unsigned flags;
+
+  IO_CALL();
+  flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+  if (ts == NULL)
+    return syscall(__NR_io_uring_enter, fdRing, submit, wait, flags, NULL, 0);
+
+  bzero(&arg, sizeof(arg));
+  arg.ts = (uint64_t)(uintptr_t)ts;
+  return syscall(__NR_io_uring_enter, fdRing, submit, wait,
+      flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/** Get a free submission entry
+ * Submits what is queued if the queue is full.
+ *
+ * @return The entry, zeroed
+ * @private
+ */
+static struct io_uring_sqe *sqe() {
+  struct io_uring_sqe *e;
+  unsigned tail;
+
+  if (queued == IOR_ENTRIES) {
+    if (enter(queued, 0, NULL) < 0)
+      warn("Error submitting to io_uring");
+    queued = 0;
+  }
+
+  // the kernel only reads the queue when entered, so the entry can be
+  // published before it is filled in
+  tail = *sqTail;
+  e = &sqes[tail & *sqMask];
+  sqArray[tail & *sqMask] = tail & *sqMask;
+  bzero(e, sizeof(*e));
+  queued++;
+  __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+  return e;
+}
+
+// Public routines
+
+/** Setup the ring
+ * Needs extended wait arguments (Linux 5.11) and multishot polls (5.13).
+ *
+ * @return False if io_uring is not available
+ */
+bool ioring_setup() {
+  struct io_uring_params p;
+
+  bzero(&p, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = IOR_ENTRIES * 2;
+  if ((fdRing = syscall(__NR_io_uring_setup, IOR_ENTRIES, &p)) < 0) {
+    errno = 0;
+    return false;
+  }
+  if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+    close(fdRing);
+    fdRing = -1;
+    return false;
+  }
+
+  sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cqSize > sqSize) sqSize = cqSize;
+    cqSize = sqSize;
+  }
+
+  sqMap = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fdRing, IORING_OFF_SQ_RING);
+  if (sqMap == MAP_FAILED)
+    die("Can't map io_uring");
+  cqMap = (p.features & IORING_FEAT_SINGLE_MMAP) ? sqMap :
+    mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fdRing, IORING_OFF_CQ_RING);
+  if (cqMap == MAP_FAILED)
+    die("Can't map io_uring");
+  sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fdRing, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED)
+    die("Can't map io_uring");
+
+  sqTail = sqMap + p.sq_off.tail;
+  sqMask = sqMap + p.sq_off.ring_mask;
+  sqArray = sqMap + p.sq_off.array;
+  cqHead = cqMap + p.cq_off.head;
+  cqTail = cqMap + p.cq_off.tail;
+  cqMask = cqMap + p.cq_off.ring_mask;
+  cqes = cqMap + p.cq_off.cqes;
+  queued = 0;
+
+  return true;
+}
+
+/** Queue a read
+ *
+ * @param fd  Where to read from
+ * @param buf Where to put the data (has to stay valid until completion)
+ * @param len Most bytes to read
+ * @param tag Tag of the request
+ */
+void ioring_read(int fd, void *buf, int len, uint64_t tag) {
+  struct io_uring_sqe *e = sqe();
+
+  e->opcode = IORING_OP_READ;
+  e->fd = fd;
+  e->addr = (uint64_t)(uintptr_t)buf;
+  e->len = len;
+  e->off = -1;
+  e->user_data = tag;
+}
+
+/** Queue a write
+ *
+ * @param fd  Where to write to
+ * @param buf The data (has to stay valid until completion)
+ * @param len Number of bytes
+ * @param tag Tag of the request
+ */
+void ioring_write(int fd, const void *buf, int len, uint64_t tag) {
+  struct io_uring_sqe *e = sqe();
+
+  e->opcode = IORING_OP_WRITE;
+  e->fd = fd;
+  e->addr = (uint64_t)(uintptr_t)buf;
+  e->len = len;
+  e->off = -1;
+  e->user_data = tag;
+}
+
+/** Queue a multishot poll for input
+ * Completes every time the FD becomes readable, until cancelled.
+ *
+ * @param fd  The FD
+ * @param tag Tag of the request
+ */
+void ioring_poll(int fd, uint64_t tag) {
+  struct io_uring_sqe *e = sqe();
+
+  e->opcode = IORING_OP_POLL_ADD;
+  e->fd = fd;
+  e->len = IORING_POLL_ADD_MULTI;
+  e->poll32_events = POLLIN;
+  e->user_data = tag;
+}
+
+/** Queue the cancellation of a request
+ * The request still completes (usually with -ECANCELED).
+ *
+ * @param tag Tag of the request
+ */
+void ioring_cancel(uint64_t tag) {
+  struct io_uring_sqe *e = sqe();
+
+  e->opcode = IORING_OP_ASYNC_CANCEL;
+  e->addr = tag;
+  e->user_data = 0;
+}
+
+/** Submit everything queued and wait for a completion
+ *
+ * @param timeout Longest wait in ms, -1 for no limit
+ * @return Completions ready, -1 on error (errno set, EINTR and ETIME are
+ *         not errors)
+ */
+int ioring_wait(int timeout) {
+  struct timespec ts;
+  int ret;
+
+  ts.tv_sec = timeout / 1000;
+  ts.tv_nsec = (timeout % 1000) * 1000000L;
+
+  ret = enter(queued, 1, timeout >= 0 ? &ts : NULL);
+  queued = 0;
+  if ((ret < 0) && ((errno == EINTR) || (errno == ETIME)))
+    errno = ret = 0;
+  if (ret < 0) return -1;
+
+  return __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) - *cqHead;
+}
+
+/** Take the next completion
+ *
+ * @param ev Where to put it
+ * @return False if there is none
+ */
+bool ioring_next(IoEvent *ev) {
+  struct io_uring_cqe *e;
+  unsigned head;
+
+  for (head = *cqHead; head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE); head++) {
+    e = &cqes[head & *cqMask];
+    if (e->user_data == 0) continue;
+
+    ev->tag = e->user_data;
+    ev->res = e->res;
+    ev->more = (e->flags & IORING_CQE_F_MORE) != 0;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  return false;
+}
+
+/** Release the ring
+ * Requests still in flight are cancelled by the kernel.
+ */
+void ioring_shutdown() {
+  if (fdRing < 0) return;
+  close(fdRing);
+  fdRing = -1;
+}
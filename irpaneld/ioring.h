@@ -0,0 +1,35 @@
+/** @file
+ * io_uring library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_IORING
+#define IRPD_IORING 1
+
+#include <stdint.h>
+
+// Configurable defines
+
+#define IOR_ENTRIES   64    //!< Submission queue size (completions get twice that)
+
+// Public types
+
+typedef struct {
+  uint64_t tag;               //!< Tag of the request
+  int res;                    //!< Its result, -errno on failure
+  bool more;                  //!< A multishot request stays armed
+} IoEvent;
+
+// Public routines
+
+bool ioring_setup(void);
+void ioring_read(int fd, void *buf, int len, uint64_t tag);
+void ioring_write(int fd, const void *buf, int len, uint64_t tag);
+void ioring_poll(int fd, uint64_t tag);
+void ioring_cancel(uint64_t tag);
+int ioring_wait(int timeout);
+bool ioring_next(IoEvent *ev);
+void ioring_shutdown(void);
+
+#endif
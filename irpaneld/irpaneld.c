@@ -17,12 +17,10 @@
 #include <stdlib.h>
 
 #include <arpa/inet.h>
-#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <string.h>
-#include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -32,13 +30,10 @@
 #include "common.h"
 #include "cli.h"
 #include "irpaneld.h"
+#include "keys.h"
+#include "screen.h"
 #include "serial.h"
 
-// Internal defines
-
-#define MODE_TCP  1 //!< Use TCP sockets
-#define MODE_UNIX 2 //!< Use UNIX sockets
-
 // fix the discrepancy between documentation and actual code
 #ifndef UNIX_PATH_MAX
   #define UNIX_PATH_MAX sizeof(sun.sun_path)
@@ -46,41 +41,107 @@
 
 // Private variables
 
-static int mode;
-static int fdServer;
-static volatile bool run;
+static int fdTcp;
+static int fdUnix;
+
+static struct {
+  char *name;                 //!< Name clients attach by
+  char *device;               //!< Serial port device
+  char *mode;                 //!< Serial port mode, NULL for the default
+  int cols;                   //!< Width in chars
+  int lines;                  //!< Height in lines
+} panel[CLI_MAXPANELS];       //!< Panels, in the order given
+static int numPanels;
 
 // Public variables
 
-int fdPanel;
-int fdClient;
 int squash;
+int rate;
+bool useRing;
+unsigned long ioCalls;
+volatile bool running;
+volatile bool dumpStats;
+volatile bool dumpTrace;
+char *tracePath;
 
 // Private routines
 
 void handler_sig(int signum) {
   fprintf(stderr, "\nCaught signal %d, quitting...\n", signum);
+  running = false;
+}
 
-  close(fdClient);
-  close(fdServer);
-  close(fdPanel);
+void handler_usr1(int signum) {
+  dumpStats = true;
+}
 
-  run = false;
+void handler_usr2(int signum) {
+  dumpTrace = true;
+}
+
+/** Parse a panel argument.
+ * The format is '[NAME=]DEVICE[:MODE][@COLSxLINES]'. The name defaults to
+ * the device file name. A device path that exists as given is never split
+ * at a ':'. Will either fully succeed or die.
+ *
+ * @param arg The argument (modified)
+ */
+void panel_parse(char *arg) {
+  char *eq, *at, *colon, *slash;
+
+  if (numPanels >= CLI_MAXPANELS)
+    die("Too many panels");
+
+  panel[numPanels].cols = SCR_CHARS;
+  panel[numPanels].lines = SCR_LINES;
+  panel[numPanels].mode = NULL;
+
+  if (((eq = strchr(arg, '=')) != NULL) && (memchr(arg, '/', eq - arg) == NULL)) {
+    *eq = 0;
+    panel[numPanels].name = arg;
+    arg = eq + 1;
+  } else
+    panel[numPanels].name = NULL;
+
+  if ((at = strrchr(arg, '@')) != NULL) {
+    if (sscanf(at + 1, "%dx%d", &panel[numPanels].cols, &panel[numPanels].lines) != 2)
+      die("Please use 'COLSxLINES' format for panel geometry");
+    *at = 0;
+  }
+
+  slash = strrchr(arg, '/');
+  if ((access(arg, F_OK) != 0) &&
+      ((colon = strchr(slash != NULL ? slash : arg, ':')) != NULL)) {
+    *colon = 0;
+    panel[numPanels].mode = colon + 1;
+  }
+  panel[numPanels].device = arg;
+
+  if (panel[numPanels].name == NULL)
+    panel[numPanels].name = (slash = strrchr(arg, '/')) != NULL ? slash + 1 : arg;
+
+  numPanels++;
 }
 
 /** Print usage.
  * @param name Name of the command
  */
 void usage(char *name) {
-  fprintf(stderr, "  Usage: %s [options...] (-t HOST:PORT|-u PATH)\n", name);
+  fprintf(stderr, "  Usage: %s [options...] [-t HOST:PORT] [-u PATH]\n", name);
   fprintf(stderr, "\nOptions:\n");
   fprintf(stderr, "\t-b         - fork into background (default: false)\n");
   fprintf(stderr, "\t-p LOG     - where to write PID (default; "STR(DEF_PID)")\n");
   fprintf(stderr, "\t-l PID     - where to write LOG (default: "STR(DEF_LOG)")\n");
-  fprintf(stderr, "\t-d DEVICE  - path to serial port device (default: "STR(DEF_DEV)")\n");
-  fprintf(stderr, "\t-m MODE    - serial port mode (default: "STR(DEF_MODE)")\n");
+  fprintf(stderr, "\t-d PANEL   - panel as [NAME=]DEVICE[:MODE][@COLSxLINES], may be repeated\n");
+  fprintf(stderr, "\t             (default: "STR(DEF_DEV)")\n");
+  fprintf(stderr, "\t-m MODE    - serial port mode of panels without one (default: "STR(DEF_MODE)")\n");
+  fprintf(stderr, "\t             as SPEED,PARITY,BITS,STOP[,FAST], FAST is the baud rate to switch to\n");
   fprintf(stderr, "\t-s NUM     - squash NUM IR packets (default: "STR(DEF_SQUASH)")\n");
-  fprintf(stderr, "\nAnd one of the following:\n");
+  fprintf(stderr, "\t-r HZ      - panel refresh rate, 0 for none (default: "STR(DEF_RATE)")\n");
+  fprintf(stderr, "\t-k KEYS    - key map to publish key names from (default: none)\n");
+  fprintf(stderr, "\t-f TRACE   - where to dump the flight recorder (default: "STR(DEF_TRACE)")\n");
+  fprintf(stderr, "\t-U         - do the I/O with io_uring, if available (default: epoll)\n");
+  fprintf(stderr, "\nAnd at least one of the following:\n");
   fprintf(stderr, "\t-t HOST:PORT - listen on a TCP socket on HOST:PORT\n");
   fprintf(stderr, "\t-u PATH      - listen on a UNIX domain socket at PATH\n");
   exit(1);
@@ -92,118 +153,142 @@ int main(int argc, char *argv[]) {
   struct sockaddr_in sin;
   struct sockaddr_un sun;
   struct hostent *he;
-  socklen_t slen;
   pid_t pid, sid;
   FILE *fLog, *fPid;
   bool background;
-  char *modeArg, *device, *serialMode, *pidPath, *logPath;
-  int opt, num;
+  SerialConfig cfg;
+  char *tcpArg, *unixArg, *device, *serialMode, *mode, *pidPath, *logPath, *keysPath;
+  int opt, num, i;
 
   signal(SIGINT, handler_sig);
   signal(SIGTERM, handler_sig);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGUSR1, handler_usr1);
+  signal(SIGUSR2, handler_usr2);
 
   if (argc < 3) usage(argv[0]);
 
   cmnStamp = false;
 
   squash = DEF_SQUASH;
+  rate = DEF_RATE;
+  useRing = false;
   background = false;
-  run = true;
-  modeArg = device = serialMode = pidPath = logPath = NULL;
+  running = true;
+  tcpArg = unixArg = serialMode = pidPath = logPath = keysPath = NULL;
+  numPanels = 0;
+  tracePath = NULL;
   he = NULL;
-  mode = fdServer = fdClient = 0;
+  fdTcp = fdUnix = -1;
 
-  while ((opt = getopt(argc, argv, "bp:l:d:m:s:t:u:")) != -1)
+  while ((opt = getopt(argc, argv, "bp:l:d:m:s:r:k:f:Ut:u:")) != -1)
     switch (opt) {
-      case 'b': background = true;                  break;
-      case 'p': pidPath = optarg;                   break;
-      case 'l': logPath = optarg;                   break;
-      case 'd': device = optarg;                    break;
-      case 'm': serialMode = optarg;                break;
-      case 's': squash = atoi(optarg);              break;
-      case 't': mode = MODE_TCP; modeArg = optarg;  break;
-      case 'u': mode = MODE_UNIX; modeArg = optarg; break;
-      default:  usage(argv[0]);                     break;
+      case 'b': background = true;      break;
+      case 'p': pidPath = optarg;       break;
+      case 'l': logPath = optarg;       break;
+      case 'd': panel_parse(optarg);    break;
+      case 'm': serialMode = optarg;    break;
+      case 's': squash = atoi(optarg);  break;
+      case 'r': rate = atoi(optarg);    break;
+      case 'k': keysPath = optarg;      break;
+      case 'f': tracePath = optarg;     break;
+      case 'U': useRing = true;         break;
+      case 't': tcpArg = optarg;        break;
+      case 'u': unixArg = optarg;       break;
+      default:  usage(argv[0]);         break;
     }
 
-  if (mode == 0) usage(argv[0]);
+  if ((tcpArg == NULL) && (unixArg == NULL)) usage(argv[0]);
+  if ((rate < 0) || (rate > 1000)) usage(argv[0]);
 
-  if (device == NULL) {
+  if (numPanels == 0) {
     device = malloc(sizeof(DEF_DEV));
     strcpy(device, DEF_DEV);
+    panel_parse(device);
   }
-  dbg(printf("DEVICE: %s\n", device));
 
   if (serialMode == NULL) {
     serialMode = malloc(sizeof(DEF_MODE));
     strcpy(serialMode, DEF_MODE);
   }
   dbg(printf("SERIAL MODE: %s\n", serialMode));
-  serial_parse(serialMode);
-
-  switch (mode) {
-    case MODE_UNIX:
-      bzero(&sun, sizeof(sun));
-      sun.sun_family = AF_UNIX;
-
-      num = strlen(modeArg);
-      if ((num < 1) || (num > UNIX_PATH_MAX))
-        die("Unix socket path to short/long");
-      if (access(modeArg, F_OK) == 0)
-        warn("File exists at the specified path");
-      strncpy((char *)&sun.sun_path, modeArg, UNIX_PATH_MAX);
-      dbg(printf("socket at: %s\n", sun.sun_path));
-      break;
-
-    case MODE_TCP:
-      bzero(&sin, sizeof(sin));
-      sin.sin_family = AF_INET;
-
-      if ((he = gethostbyname(strtok(modeArg, ":"))) == NULL)
-        die("Can't find IP for the supplied HOST");
-      memcpy(he->h_addr_list[0], &sin.sin_addr, sizeof(sin.sin_addr));
-
-      num = atoi(strtok(NULL, ":"));
-      if ((num < 1) || (num > 65535))
-        die("Invalid PORT number");
-      sin.sin_port = htons(num);
-      dbg(printf("host: '%s' port: '%d'\n", he->h_name, num));
-      break;
-    default:
-      usage(argv[0]);
-      break;
+
+  if (keysPath != NULL)
+    keys_load(keysPath);
+
+  if (tracePath == NULL) {
+    tracePath = malloc(sizeof(DEF_TRACE));
+    strcpy(tracePath, DEF_TRACE);
+  }
+  dbg(printf("trace path: %s\n", tracePath));
+
+  if (unixArg != NULL) {
+    bzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+
+    num = strlen(unixArg);
+    if ((num < 1) || (num >= UNIX_PATH_MAX))
+      die("Unix socket path to short/long");
+    if (access(unixArg, F_OK) == 0)
+      warn("File exists at the specified path");
+    strncpy((char *)&sun.sun_path, unixArg, UNIX_PATH_MAX - 1);
+    dbg(printf("socket at: %s\n", sun.sun_path));
   }
 
-  if ((fdPanel = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
-    die("Can't open serial port device");
-  if (flock(fdPanel, LOCK_EX) != 0)
-    die("Can't lock serial port");
-  serial_setup(fdPanel);
+  if (tcpArg != NULL) {
+    bzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
 
-  cli_setup();
+    if ((he = gethostbyname(strtok(tcpArg, ":"))) == NULL)
+      die("Can't find IP for the supplied HOST");
+    memcpy(&sin.sin_addr, he->h_addr_list[0], sizeof(sin.sin_addr));
+
+    num = atoi(strtok(NULL, ":"));
+    if ((num < 1) || (num > 65535))
+      die("Invalid PORT number");
+    sin.sin_port = htons(num);
+    dbg(printf("host: '%s' port: '%d'\n", he->h_name, num));
+  }
 
-  switch (mode) {
-    case MODE_UNIX:
-      if ((fdServer = socket(PF_UNIX, SOCK_STREAM, 0)) < 0)
-        die("Can't create a UNIX socket");
+  cli_setup();
 
-      if (bind(fdServer, (struct sockaddr *)&sun, sizeof(sun)) != 0)
-        die("Can't bind socket to specified PATH");
-      break;
+  for (i = 0; i < numPanels; i++) {
+    dbg(printf("PANEL %s: %s\n", panel[i].name, panel[i].device));
+    if (panel[i].mode == NULL)
+      panel[i].mode = serialMode;
+    if ((mode = strdup(panel[i].mode)) == NULL)
+      die("Can't copy serial port mode");
+    serial_parse(mode, &cfg);
+    free(mode);
+    cli_panel(panel[i].name, panel[i].device, &cfg, panel[i].cols, panel[i].lines);
+  }
 
-    case MODE_TCP:
-      if ((fdServer = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-        die("Can't create a TCP socket");
+  if (unixArg != NULL) {
+    if ((fdUnix = socket(PF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      die("Can't create a UNIX socket");
 
-      if (bind(fdServer, (struct sockaddr *)&sin, sizeof(sin)) != 0)
-        die("Can't bind socket to specified HOST:PORT");
+    if (bind(fdUnix, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+      die("Can't bind socket to specified PATH");
 
-      setsockopt(fdServer, SOL_SOCKET, SO_REUSEADDR, &num, sizeof(num));
-      break;
+    if (listen(fdUnix, CLI_BACKLOG) != 0)
+      die("Can't listen on UNIX socket");
+    cli_listen(fdUnix);
   }
 
-  if (listen(fdServer, 1) != 0)
-    die("Can't listen on socket");
+  if (tcpArg != NULL) {
+    if ((fdTcp = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      die("Can't create a TCP socket");
+
+    num = 1;
+    setsockopt(fdTcp, SOL_SOCKET, SO_REUSEADDR, &num, sizeof(num));
+
+    if (bind(fdTcp, (struct sockaddr *)&sin, sizeof(sin)) != 0)
+      die("Can't bind socket to specified HOST:PORT");
+
+    if (listen(fdTcp, CLI_BACKLOG) != 0)
+      die("Can't listen on TCP socket");
+    cli_listen(fdTcp);
+  }
 
   if (background) {
     if (pidPath == NULL) {
@@ -246,45 +331,24 @@ int main(int argc, char *argv[]) {
     fprintf(fPid, "%d\n", sid);
     fclose(fPid);
 
-    note("Panel device: %s", device);
-    note("Serial config: %s", serialMode);
-    switch (mode) {
-      case MODE_UNIX:
-        note("UNIX socket at: %s", sun.sun_path);               break;
-      case MODE_TCP:
-        note("TCP socket at: %s:%d", he->h_name, ntohs(sin.sin_port)); break;
-    }
+    for (i = 0; i < numPanels; i++)
+      note("Panel %s: %s, %s", panel[i].name, panel[i].device, panel[i].mode);
+    if (unixArg != NULL)
+      note("UNIX socket at: %s", sun.sun_path);
+    if (tcpArg != NULL)
+      note("TCP socket at: %s:%d", he->h_name, ntohs(sin.sin_port));
   }
 
-  while (run) {
-    dbg(printf("Waiting for client...\n"));
-    switch (mode) {
-      case MODE_UNIX:
-        if (((fdClient = accept(fdServer, (struct sockaddr *)&sun, &slen)) < 0) && run)
-          die("Error on accept");
-        break;
-
-      case MODE_TCP:
-        if ((fdClient = accept(fdServer, (struct sockaddr *)&sin, &slen)) < 0) {
-          if (run) die("Error on accept");
-          else break;
-        }
-        note("Client from: %s:%d", inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-        break;
-    }
-
-    if (!run) break;
+  cli_loop();
 
-    note("Client connected");
-    cli_loop();
-    note("Client disconnected");
-    close(fdClient);
-  }
-
-  if (mode == MODE_UNIX)
+  cli_shutdown();
+  if (fdTcp >= 0)
+    close(fdTcp);
+  if (fdUnix >= 0) {
+    close(fdUnix);
     if (unlink(sun.sun_path) != 0)
       warn("Can't remove UNIX socket");
-
+  }
   if (background)
     if (unlink(pidPath) != 0)
       warn("Can't remove PID file");
@@ -12,13 +12,24 @@
 #define DEF_DEV     "/dev/ttyUSB0"  //!< Default device to open
 #define DEF_MODE    "9600,n,8,1"    //!< Default serial port mode
 #define DEF_SQUASH  2               //!< Default squash for IR packets
+#define DEF_RATE    10              //!< Default panel refresh rate (Hz)
 #define DEF_PID     "irpaneld.pid"  //!< Default pid file
 #define DEF_LOG     "irpaneld.log"  //!< Default log file
+#define DEF_TRACE   "irpaneld.trace" //!< Default flight recorder dump file
+
+// Public defines
+
+#define IO_CALL() __atomic_fetch_add(&ioCalls, 1, __ATOMIC_RELAXED) //!< Count a system call (any thread)
 
 // Public variables
 
-extern int fdPanel;   //!< FD for the panel connection
-extern int fdClient;  //!< FD for the client communication
-extern int squash;    //!< For IR packet squashing
+extern int squash;            //!< For IR packet squashing
+extern int rate;              //!< Panel refresh rate, 0 to send right away
+extern bool useRing;          //!< Do the I/O with io_uring if available
+extern unsigned long ioCalls; //!< I/O system calls made so far
+extern volatile bool running; //!< Cleared by the signal handler to stop the loop
+extern volatile bool dumpStats; //!< Set by SIGUSR1 to log the statistics
+extern volatile bool dumpTrace; //!< Set by SIGUSR2 to dump the flight recorder
+extern char *tracePath;       //!< Where the flight recorder is dumped
 
 #endif
@@ -0,0 +1,141 @@
+/** @file
+ * Key map library
+ *
+ * Loads the remote key map (the same CSV format readkeys produces) once,
+ * so key events can be published by name, and matches them against the
+ * filters subscribers register.
+ *
+ * A filter is a bit per RC5 code, so matching an event against any number
+ * of subscribers costs one bit test each.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+
+#include "common.h"
+#include "keys.h"
+
+// Internal variables
+
+static char names[KEY_MAXKEYS][KEY_MAXNAME+1]; //!< Key names
+static int codes[KEY_MAXKEYS];                 //!< Key codes
+static int numKeys;                            //!< Number of mapped keys
+static short byCode[KEY_CODES];                //!< Key index by code, -1 if unmapped
+
+// Internal routines
+
+/** Set the filter bit for a code
+ *
+ * @param f    The filter
+ * @param code The code
+ * @private
+ */
+static void set_bit(KeyFilter *f, int code) {
+  f->bits[code >> 3] |= 1 << (code & 7);
+}
+
+// Public routines
+
+/** Load the key map
+ * Lines look like '"name",addr,cmd'. Will either fully succeed or die.
+ * Without a key map all keys are unnamed.
+ *
+ * @param path Path to the CSV file
+ */
+void keys_load(const char *path) {
+  char line[128], name[KEY_MAXNAME+1];
+  int addr, cmd, num;
+  FILE *f;
+
+  memset(&byCode, 0xff, sizeof(byCode));
+  numKeys = 0;
+
+  if ((f = fopen(path, "r")) == NULL)
+    die("Can't open key map");
+
+  for (num = 1; fgets(line, sizeof(line), f) != NULL; num++) {
+    if ((line[0] == '\n') || (line[0] == '#')) continue;
+    if (sscanf(line, "\"%32[^\"]\",%d,%d", name, &addr, &cmd) != 3) {
+      note("Key map line %d: parse failed", num);
+      continue;
+    }
+    if ((addr < 0) || (addr > 31) || (cmd < 0) || (cmd > 63)) {
+      note("Key map line %d: code out of range", num);
+      continue;
+    }
+    if (numKeys == KEY_MAXKEYS)
+      die("Too many keys in key map");
+
+    strcpy(names[numKeys], name);
+    codes[numKeys] = KEY_CODE(addr, cmd);
+    byCode[codes[numKeys]] = numKeys;
+    numKeys++;
+  }
+
+  fclose(f);
+  note("Loaded %d keys", numKeys);
+}
+
+/** Name of a key
+ *
+ * @param code The code
+ * @return The name, NULL if the code is not mapped
+ */
+const char *keys_name(int code) {
+  if ((numKeys == 0) || (byCode[code] < 0)) return NULL;
+  return names[byCode[code]];
+}
+
+/** Set a filter from its text form
+ * The spec is a comma separated list of key names, 'ADDR:CMD' codes,
+ * '*' for every key and '@focus' to only get keys while focused. An
+ * empty spec matches nothing. The filter is only changed if the whole
+ * spec is valid.
+ *
+ * @param f    The filter
+ * @param spec The spec (will be modified)
+ * @return NULL if set, the error message otherwise
+ */
+const char *keys_filter(KeyFilter *f, char *spec) {
+  KeyFilter nf;
+  char *tok, *save;
+  int addr, cmd, i;
+
+  bzero(&nf, sizeof(nf));
+
+  for (tok = strtok_r(spec, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+    if (strcmp(tok, "*") == 0)
+      memset(&nf.bits, 0xff, sizeof(nf.bits));
+    else if (strcmp(tok, "@focus") == 0)
+      nf.focused = true;
+    else if (sscanf(tok, "%d:%d", &addr, &cmd) == 2) {
+      if ((addr < 0) || (addr > 31) || (cmd < 0) || (cmd > 63))
+        return "key code out of range";
+      set_bit(&nf, KEY_CODE(addr, cmd));
+    } else {
+      for (i = 0; i < numKeys; i++)
+        if (strcmp(tok, names[i]) == 0) break;
+      if (i == numKeys)
+        return "unknown key";
+      set_bit(&nf, codes[i]);
+    }
+  }
+
+  *f = nf;
+  return NULL;
+}
+
+/** Check whether a filter wants a key
+ *
+ * @param f    The filter
+ * @param code The code
+ * @return True if it matches
+ */
+bool keys_match(const KeyFilter *f, int code) {
+  return (f->bits[code >> 3] >> (code & 7)) & 1;
+}
@@ -0,0 +1,35 @@
+/** @file
+ * Key map library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_KEYS
+#define IRPD_KEYS 1
+
+// Configurable defines
+
+#define KEY_MAXNAME   32    //!< Maximum length of a key name
+#define KEY_MAXKEYS   128   //!< Maximum number of mapped keys
+#define KEY_MAXSPEC   1024  //!< Maximum length of a filter spec
+
+// Public defines
+
+#define KEY_CODES     2048  //!< Distinct RC5 codes (5-bit address, 6-bit command)
+#define KEY_CODE(addr, cmd) ((((addr) & 0x1f) << 6) | ((cmd) & 0x3f)) //!< Code index
+
+// Public types
+
+typedef struct {
+  unsigned char bits[KEY_CODES / 8]; //!< One bit per RC5 code
+  bool focused;                      //!< Only while the subscriber has focus
+} KeyFilter;
+
+// Public routines
+
+void keys_load(const char *path);
+const char *keys_name(int code);
+const char *keys_filter(KeyFilter *f, char *spec);
+bool keys_match(const KeyFilter *f, int code);
+
+#endif
@@ -0,0 +1,719 @@
+/** @file
+ * Panel link library
+ *
+ * Handles the packet exchange with the irpanel firmware. Packets are
+ * length-prefixed, the firmware acks every command with a 'd' packet.
+ *
+ * Instead of waiting for each ack the link keeps up to a window of
+ * commands in flight, as advertised by the firmware in reply to a 'w'
+ * command (firmware that does not know 'w' just acks it, which gives a
+ * window of one). Acks arrive in order, so each one is matched to the
+ * oldest command in flight. Commands not acked within LNK_TIMEOUT are
+ * considered lost. Commands beyond the window wait in a queue. Should the
+ * panel get more than it has room for anyway, it says so with an 'o'
+ * packet in place of the acks, and those commands are lost as well.
+ *
+ * Nothing here ever blocks. Commands go out through an output queue that
+ * is written whenever the panel takes more, so everything pumped at once
+ * leaves in one write. Input is read in bulk into a ring and decoded
+ * from there, so frames may be split across reads. Bytes that can not
+ * start a valid frame are skipped until the framing is found again, and
+ * a partial frame is dropped if the rest does not arrive within
+ * LNK_FRAMETIMEOUT.
+ *
+ * A link outlives its connection. When the panel goes away (or stops
+ * acking, see link_dead()) the connection is closed with link_close(),
+ * which drops everything not yet acked, and a new one is handed over
+ * with link_open(), which negotiates the window again. Statistics carry
+ * over.
+ *
+ * All state is kept per link, so there can be as many as there are
+ * panels. Nothing here is thread safe. Once set up, each link is driven
+ * from a thread of its own (see relay.c), and only from there.
+ *
+ * Everything crossing the link is recorded (see trace.c), and errors on
+ * it trigger a trace dump.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "hist.h"
+#include "irpaneld.h"
+#include "link.h"
+#include "outq.h"
+#include "serial.h"
+#include "trace.h"
+
+#if LNK_MAXWINDOW >= 255
+  #error "LNK_MAXWINDOW has to stay below 255, the most overflows the firmware counts"
+#endif
+
+// Internal routines
+
+/** Monotonic time in milliseconds
+ *
+ * @return The time
+ * @private
+ */
+static long now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/** Write out what the panel takes
+ *
+ * @param l The link
+ * @private
+ */
+static void drain(Link *l) {
+  long start;
+  int before, left;
+
+  if ((l->out.count == 0) || l->failed) return;
+
+  start = hist_now();
+  before = l->out.count;
+  if ((left = outq_flush(&l->out)) < 0) {
+    warn("Panel write failed");
+    trace_add(TRC_WRITE_FAIL, l->id, NULL, 0);
+    trace_trigger();
+    l->failed = true;
+    return;
+  }
+
+  hist_add(&l->stats.blocked, hist_now() - start);
+  STAT_ADD(l->stats.bytesOut, before - left);
+}
+
+/** Write queued commands while there is credit
+ *
+ * @param l The link
+ * @private
+ */
+static void pump(Link *l) {
+  Flight *f;
+  unsigned char *pkt;
+
+  while ((l->queueCount > 0) && (l->flightCount < l->window)) {
+    pkt = l->queue[l->queueHead];
+    l->queueHead = (l->queueHead + 1) % LNK_QUEUE;
+    l->queueCount--;
+
+    if (!outq_put(&l->out, pkt, pkt[0]+1)) {
+      warn("Panel output queue full");
+      l->retired++;
+      l->onLost(l->ctx, pkt);
+      continue;
+    }
+    STAT_ADD(l->stats.pktOut, 1);
+    trace_add(TRC_PANEL_OUT, l->id, pkt, pkt[0]+1);
+
+    f = &l->flights[(l->flightHead + l->flightCount) % LNK_MAXWINDOW];
+    memcpy(&f->pkt, pkt, pkt[0]+1);
+    f->sent = now_ms();
+    f->stamp = hist_now();
+    l->flightCount++;
+  }
+
+  drain(l);
+}
+
+/** Drop the oldest command in flight
+ *
+ * @param l     The link
+ * @param acked True if it was acked, false if it got lost
+ * @private
+ */
+static void retire(Link *l, bool acked) {
+  if (l->flightCount == 0) {
+    warn("Ack without a command in flight");
+    trace_trigger();
+    return;
+  }
+
+  if (!acked) {
+    note("Command '%c' not acked", l->flights[l->flightHead].pkt[1]);
+    l->lostRun++;
+    STAT_ADD(l->stats.lost, 1);
+    trace_add(TRC_TIMEOUT, l->id, l->flights[l->flightHead].pkt, l->flights[l->flightHead].pkt[0]+1);
+    trace_trigger();
+    l->onLost(l->ctx, l->flights[l->flightHead].pkt);
+  } else {
+    l->lostRun = 0;
+    hist_add(&l->stats.rtt, hist_now() - l->flights[l->flightHead].stamp);
+  }
+
+  l->flightHead = (l->flightHead + 1) % LNK_MAXWINDOW;
+  l->flightCount--;
+  l->retired++;
+  pump(l);
+}
+
+/** Drop commands in flight the panel had no room for
+ * Unlike a lost ack this says nothing about the panel being alive. The
+ * firmware count stops at 255, which with fewer commands than that in
+ * flight is never reached, so the count is exact.
+ *
+ * @param l     The link
+ * @param count Number of commands
+ * @private
+ */
+static void overflow(Link *l, int count) {
+  while ((count-- > 0) && (l->flightCount > 0)) {
+    note("Command '%c' overflowed the panel", l->flights[l->flightHead].pkt[1]);
+    l->lostRun = 0;
+    STAT_ADD(l->stats.overflows, 1);
+    l->onLost(l->ctx, l->flights[l->flightHead].pkt);
+    l->flightHead = (l->flightHead + 1) % LNK_MAXWINDOW;
+    l->flightCount--;
+    l->retired++;
+  }
+  trace_trigger();
+  pump(l);
+}
+
+/** Dispatch a packet read from the panel
+ *
+ * @param l The link
+ * @private
+ */
+static void dispatch(Link *l) {
+  switch (l->bufPanelIn[1]) {
+    case 'd': // done, ack of the oldest command
+      retire(l, true);
+      break;
+
+    case 'w': // window, acks the 'w' command
+      l->window = l->bufPanelIn[2];
+      if (l->window < 1) l->window = 1;
+      if (l->window > LNK_MAXWINDOW) l->window = LNK_MAXWINDOW;
+      retire(l, true);
+      break;
+
+    case 'o': // overflow, commands dropped in place of their acks
+      overflow(l, l->bufPanelIn[2]);
+      break;
+
+    default:
+      l->onInput(l->ctx, l->bufPanelIn);
+      break;
+  }
+}
+
+/** Byte from the receive ring
+ *
+ * @param l The link
+ * @param i Offset from the oldest byte
+ * @return The byte
+ * @private
+ */
+static unsigned char rx_at(Link *l, int i) {
+  return l->rx[(l->rxHead + i) % LNK_RXBUF];
+}
+
+/** Drop bytes from the receive ring
+ *
+ * @param l The link
+ * @param n Number of bytes
+ * @private
+ */
+static void rx_drop(Link *l, int n) {
+  l->rxHead = (l->rxHead + n) % LNK_RXBUF;
+  l->rxCount -= n;
+}
+
+/** Check whether a frame header is plausible
+ *
+ * @param len  Payload length
+ * @param type Packet type (first payload byte)
+ * @return True if such a frame can come from the firmware
+ * @private
+ */
+static bool frame_valid(int len, unsigned char type) {
+  switch (type) {
+    case 'd': return len == 1;
+    case 'w': return len == 2;
+    case 'o': return len == 2;
+    case 'i': return (len == 3) || (len == 7);
+    default:  return false;
+  }
+}
+
+/** Pull everything available from the panel into the receive ring
+ * Never blocks.
+ *
+ * @param l The link
+ * @return False on EOF or a read error
+ * @private
+ */
+static bool rx_fill(Link *l) {
+  int tail, room, count;
+
+  while (l->rxCount < LNK_RXBUF) {
+    tail = (l->rxHead + l->rxCount) % LNK_RXBUF;
+    room = (tail >= l->rxHead) ? LNK_RXBUF - tail : l->rxHead - tail;
+    if (room > LNK_RXBUF - l->rxCount) room = LNK_RXBUF - l->rxCount;
+
+    IO_CALL();
+    if ((count = read(l->fd, &l->rx[tail], room)) > 0) {
+      l->rxCount += count;
+      STAT_ADD(l->stats.bytesIn, count);
+    } else if (count == 0)
+      return false;
+    else if (errno == EINTR) {
+      errno = 0;
+      STAT_ADD(l->stats.retries, 1);
+    } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      errno = 0;
+      return true;
+    } else {
+      warn("Panel read failed");
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/** Decode all complete frames in the receive ring
+ * Bytes that can not start a valid frame are skipped one at a time,
+ * which resynchronises the framing after garbage.
+ *
+ * @param l The link
+ * @private
+ */
+static void rx_parse(Link *l) {
+  int len, i, skipped;
+  bool progress;
+
+  skipped = 0;
+  progress = false;
+
+  while (l->rxCount > 0) {
+    len = rx_at(l, 0);
+    if ((len < 1) || (len > LNK_PANELBUF)) {
+      rx_drop(l, 1);
+      skipped++;
+      continue;
+    }
+    if (l->rxCount < 2) break;
+    if (!frame_valid(len, rx_at(l, 1))) {
+      rx_drop(l, 1);
+      skipped++;
+      continue;
+    }
+    if (l->rxCount < len + 1) break;
+
+    for (i = 0; i <= len; i++)
+      l->bufPanelIn[i] = rx_at(l, i);
+    l->bufPanelIn[len+1] = 0;
+    rx_drop(l, len + 1);
+    STAT_ADD(l->stats.pktIn, 1);
+    trace_add(TRC_PANEL_IN, l->id, l->bufPanelIn, len + 1);
+    progress = true;
+    dispatch(l);
+  }
+
+  if (skipped > 0) {
+    note("Skipped %d bytes of garbage from panel", skipped);
+    STAT_ADD(l->stats.garbage, skipped);
+    trace_add(TRC_GARBAGE, l->id, &skipped, sizeof(skipped));
+    trace_trigger();
+  }
+
+  if (l->rxCount == 0)
+    l->partialSince = -1;
+  else if (progress || (skipped > 0) || (l->partialSince < 0))
+    l->partialSince = now_ms();
+}
+
+// Public routines
+
+/** Setup the link
+ * There is no connection yet, see link_open().
+ *
+ * @param l     The link
+ * @param id    Panel index, for the trace
+ * @param input Called with every packet that is not an ack
+ * @param lost  Called with every command that was not acked
+ * @param ctx   Passed to the callbacks
+ */
+void link_setup(Link *l, int id, LinkHandler input, LinkHandler lost, void *ctx) {
+  l->fd = -1;
+  l->id = id;
+  l->onInput = input;
+  l->onLost = lost;
+  l->ctx = ctx;
+  l->accepted = l->retired = 0;
+  bzero(&l->stats, sizeof(l->stats));
+  l->flightHead = l->flightCount = 0;
+  l->queueHead = l->queueCount = 0;
+  outq_init(&l->out, -1);
+  l->window = 1;
+  STAT_SET(l->speed, 0);
+  l->slowOnce = false;
+  l->retryAt = 0;
+}
+
+/** Wait until nothing is in flight
+ * Blocks, up to LNK_PROBE. Whatever is still in flight then is given up
+ * on (without calling back).
+ *
+ * @param l The link
+ * @return True if everything was acked
+ * @private
+ */
+static bool settle(Link *l) {
+  struct pollfd pfd;
+  long until;
+  int left;
+
+  pfd.fd = l->fd;
+  until = now_ms() + LNK_PROBE;
+  while (((left = until - now_ms()) > 0) && (l->flightCount > 0) && !l->failed) {
+    pfd.events = link_writing(l) ? POLLIN | POLLOUT : POLLIN;
+    if (poll(&pfd, 1, left) <= 0) continue;
+    if (pfd.revents & POLLOUT) link_output(l);
+    if (pfd.revents & POLLIN) link_input(l);
+  }
+  l->partialSince = -1;
+  l->rxCount = 0;
+
+  if (l->flightCount == 0) return true;
+  l->flightCount = 0;
+  l->retired = l->accepted;
+  return false;
+}
+
+/** Negotiate the window
+ *
+ * @param l The link
+ * @return False if the panel did not reply (the window is then one)
+ * @private
+ */
+static bool query(Link *l) {
+  unsigned char pkt[2] = {1, 'w'};
+
+  l->window = 1;
+  link_send(l, pkt);
+  return settle(l);
+}
+
+/** Negotiate the window at a baud rate
+ *
+ * @param l     The link
+ * @param speed The baud rate
+ * @return False if the panel did not reply (the window is then one)
+ * @private
+ */
+static bool probe(Link *l, int speed) {
+  if (!serial_speed(l->fd, speed)) return false;
+  STAT_SET(l->speed, speed);
+  return query(l);
+}
+
+/** Panel UBRR for a baud rate
+ * In double speed mode, baud = clock / (8 * (ubrr + 1)).
+ *
+ * @param speed The baud rate
+ * @return The UBRR, -1 if the panel can't get close enough
+ * @private
+ */
+static long panel_ubrr(int speed) {
+  long ubrr, real;
+
+  ubrr = (LNK_PANELCLOCK + 4L * speed) / (8L * speed) - 1;
+  real = LNK_PANELCLOCK / (8L * (ubrr + 1));
+  if ((ubrr < 0) || (ubrr > 0xff) || (labs(real - speed) * 1000 > speed * LNK_BAUDERROR))
+    return -1;
+  return ubrr;
+}
+
+/** Switch the panel to the fast baud rate
+ * Does not wait on failure: the port is back at the old rate, and the
+ * panel will be once it gives up on the new one (within LNK_TRIAL).
+ *
+ * @param l   The link
+ * @param cfg The serial config
+ * @return True if the panel answers at the new rate
+ * @private
+ */
+static bool speed_up(Link *l, const SerialConfig *cfg) {
+  unsigned char pkt[4] = {3, 'b', 0, 1};
+
+  pkt[2] = panel_ubrr(cfg->fast);
+  link_send(l, pkt);
+  if (!settle(l)) {
+    warn("Baud rate switch not acked");
+    return false;
+  }
+
+  if (probe(l, cfg->fast)) return true;
+
+  warn("No reply at the new baud rate, falling back");
+  serial_speed(l->fd, cfg->speed);
+  STAT_SET(l->speed, cfg->speed);
+  return false;
+}
+
+/** Take over a panel connection and negotiate the window
+ * The connection has to be open and setup already, and the link closed.
+ * Whatever the panel had sent before is dumped. With a fast rate in the
+ * config the panel is switched to it (or found at it already, after a
+ * reopen). When the switch fails the link is not usable before
+ * link_retry(), and the next open stays at the old rate.
+ *
+ * @param l   The link
+ * @param fd  The panel connection
+ * @param cfg Its serial config
+ * @return False if the panel did not reply, or the switch failed
+ */
+bool link_open(Link *l, int fd, const SerialConfig *cfg) {
+  bool replied;
+
+  l->fd = fd;
+  l->rxHead = l->rxCount = 0;
+  l->partialSince = -1;
+  l->lostRun = 0;
+  outq_free(&l->out);
+  outq_init(&l->out, l->fd);
+  l->failed = false;
+
+  while (read(l->fd, &l->rx, sizeof(l->rx)) > 0) {
+    note("Dumping stale panel data...");
+  }
+  errno = 0;
+
+  replied = probe(l, cfg->speed) || ((cfg->fast > 0) && probe(l, cfg->fast));
+  if (!replied) {
+    warn("No reply to window query");
+    serial_speed(l->fd, cfg->speed);
+    STAT_SET(l->speed, cfg->speed);
+  } else if ((cfg->fast > 0) && (l->speed != cfg->fast)) {
+    if (panel_ubrr(cfg->fast) < 0)
+      warn("Panel can't do that baud rate");
+    else if (l->slowOnce)
+      l->slowOnce = false;
+    else if (!speed_up(l, cfg)) {
+      l->slowOnce = true;
+      l->retryAt = now_ms() + LNK_TRIAL;
+      replied = false;
+    }
+  }
+
+  note("Panel window: %d, %d baud", l->window, l->speed);
+  return replied;
+}
+
+/** Time until the panel is worth opening again
+ * That is after a failed baud rate switch, until the panel is surely
+ * back at the old rate.
+ *
+ * @param l The link
+ * @return Milliseconds, 0 for now
+ */
+int link_retry(Link *l) {
+  long left = l->retryAt - now_ms();
+
+  return left > 0 ? left : 0;
+}
+
+/** Close the panel connection
+ * Commands in flight or queued are dropped, without calling back, and
+ * count as done (see link_reached()).
+ *
+ * @param l The link
+ */
+void link_close(Link *l) {
+  int count;
+
+  if ((count = link_pending(l)) > 0) {
+    note("Dropping %d commands for the panel", count);
+    STAT_ADD(l->stats.dropped, count);
+    l->retired += count;
+  }
+  l->flightCount = l->queueCount = 0;
+  l->rxCount = 0;
+  l->partialSince = -1;
+  outq_free(&l->out);
+
+  if (l->fd >= 0) close(l->fd);
+  l->fd = -1;
+}
+
+/** Check whether the panel stopped acking
+ * That is LNK_DEADLOST commands lost in a row, which a working panel
+ * does not do.
+ *
+ * @param l The link
+ * @return True if the panel seems dead
+ */
+bool link_dead(Link *l) {
+  return l->lostRun >= LNK_DEADLOST;
+}
+
+/** Send a command to the panel
+ * Never blocks. The command is written right away if there is credit,
+ * otherwise it is queued until enough acks come back.
+ *
+ * @param l   The link
+ * @param pkt The packet (length-prefixed)
+ * @return True if accepted, false if the queue is full
+ */
+bool link_send(Link *l, const unsigned char *pkt) {
+  if (l->queueCount >= LNK_QUEUE) {
+    warn("Panel queue full");
+    STAT_ADD(l->stats.refused, 1);
+    return false;
+  }
+
+  memcpy(&l->queue[(l->queueHead + l->queueCount) % LNK_QUEUE], pkt, pkt[0]+1);
+  l->queueCount++;
+  l->accepted++;
+  pump(l);
+
+  return true;
+}
+
+/** Check whether commands are waiting for credit
+ *
+ * @param l The link
+ * @return True if the link is backed up
+ */
+bool link_busy(Link *l) {
+  return l->queueCount > 0;
+}
+
+/** Negotiated window
+ *
+ * @param l The link
+ * @return Most commands the panel takes at once
+ */
+int link_window(Link *l) {
+  return l->window;
+}
+
+/** Count the commands not done with yet
+ * Queued or in flight.
+ *
+ * @param l The link
+ * @return The count
+ */
+int link_pending(Link *l) {
+  return l->queueCount + l->flightCount;
+}
+
+/** Mark the commands sent so far
+ *
+ * @param l The link
+ * @return The mark, see link_reached()
+ */
+unsigned long link_mark(Link *l) {
+  return l->accepted;
+}
+
+/** Check whether the panel is done with everything before a mark
+ * Lost commands count as done.
+ *
+ * @param l    The link
+ * @param mark The mark
+ * @return True if done
+ */
+bool link_reached(Link *l, unsigned long mark) {
+  return l->retired >= mark;
+}
+
+/** Process input from the panel
+ * Call when the panel FD is readable. Never blocks.
+ *
+ * @param l The link
+ * @return False if the panel went away
+ */
+bool link_input(Link *l) {
+  bool ok;
+
+  ok = rx_fill(l);
+  rx_parse(l);
+
+  return ok && !l->failed;
+}
+
+/** Check whether bytes wait for the panel to take them
+ * The panel FD should be polled for writing while this holds.
+ *
+ * @param l The link
+ * @return True if output is pending
+ */
+bool link_writing(Link *l) {
+  return l->out.count > 0;
+}
+
+/** Write pending output to the panel
+ * Call when the panel FD is writable. Never blocks.
+ *
+ * @param l The link
+ * @return False if the panel went away
+ */
+bool link_output(Link *l) {
+  drain(l);
+  return !l->failed;
+}
+
+/** Time until the next link deadline
+ * That is either the ack of the oldest command in flight, or the rest of
+ * a partially received frame.
+ *
+ * @param l The link
+ * @return Milliseconds, -1 if there is nothing to wait for
+ */
+int link_timeout(Link *l) {
+  long next, left;
+
+  next = -1;
+  if (l->flightCount > 0)
+    next = l->flights[l->flightHead].sent + LNK_TIMEOUT;
+  if ((l->partialSince >= 0) &&
+      ((next < 0) || (l->partialSince + LNK_FRAMETIMEOUT < next)))
+    next = l->partialSince + LNK_FRAMETIMEOUT;
+
+  if (next < 0) return -1;
+  left = next - now_ms();
+  return left > 0 ? left : 0;
+}
+
+/** Handle link deadlines that have passed
+ * Commands in flight past their timeout are dropped as lost, and a
+ * stale partial frame is given up on (hunting for the next frame start
+ * within it).
+ *
+ * @param l The link
+ */
+void link_expire(Link *l) {
+  long t = now_ms();
+
+  while ((l->flightCount > 0) && (l->flights[l->flightHead].sent + LNK_TIMEOUT <= t))
+    retire(l, false);
+
+  if ((l->partialSince >= 0) && (l->partialSince + LNK_FRAMETIMEOUT <= t)) {
+    note("Dropping stale partial frame from panel");
+    STAT_ADD(l->stats.partial, 1);
+    trace_add(TRC_PARTIAL, l->id, l->rx + l->rxHead, 1);
+    trace_trigger();
+    rx_drop(l, 1);
+    l->partialSince = -1;
+    rx_parse(l);
+  }
+}
@@ -0,0 +1,108 @@
+/** @file
+ * Panel link library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_LINK
+#define IRPD_LINK 1
+
+#include "outq.h"
+#include "serial.h"
+
+// Configurable defines
+
+#define LNK_PANELBUF  24    //!< This is used for I/O with panel
+#define LNK_MAXWINDOW 8     //!< Most commands kept in flight (below 255, see overflow() in link.c)
+#define LNK_QUEUE     64    //!< Most commands waiting for credit
+#define LNK_RXBUF     256   //!< Receive ring size
+#define LNK_TIMEOUT   500   //!< Ack timeout in ms
+#define LNK_PROBE     150   //!< Ms the panel gets to answer while opening (above CLI_STALE, so a garbled probe is dropped before the next)
+#define LNK_FRAMETIMEOUT 100 //!< Partial frame timeout in ms
+#define LNK_DEADLOST  2     //!< Commands lost in a row before the panel is considered dead
+#define LNK_PANELCLOCK 8000000L //!< Panel MCU clock in Hz (F_CPU of the firmware)
+#define LNK_BAUDERROR 20    //!< Largest baud rate error the panel is switched with, in permille
+#define LNK_TRIAL     1100  //!< Ms until the firmware gives up on an unconfirmed baud rate (see CLI_TRIAL)
+
+// Public types
+
+// written by the link thread, read by any with STAT_GET()
+typedef struct {
+  unsigned long pktOut;       //!< Commands written to the panel
+  unsigned long bytesOut;     //!< Bytes written to the panel
+  unsigned long pktIn;        //!< Packets read from the panel
+  unsigned long bytesIn;      //!< Bytes read from the panel
+  unsigned long lost;         //!< Commands never acked
+  unsigned long garbage;      //!< Bytes skipped while hunting for a frame
+  unsigned long partial;      //!< Partial frames given up on
+  unsigned long refused;      //!< Commands refused with a queue full
+  unsigned long overflows;    //!< Commands the panel had no room for
+  unsigned long retries;      //!< Reads interrupted and retried
+  unsigned long dropped;      //!< Commands dropped with the connection
+  unsigned long reopens;      //!< Times the connection was opened again
+  Hist rtt;                   //!< Ack round-trip time
+  Hist blocked;               //!< Time spent in writes to the panel
+} LinkStats;
+
+typedef void (*LinkHandler)(void *ctx, const unsigned char *pkt); //!< Packet callback (length-prefixed)
+
+typedef struct {
+  unsigned char pkt[LNK_PANELBUF+1];  //!< Copy of the packet
+  long sent;                        //!< When it was sent (ms)
+  long stamp;                       //!< When it was sent (us), for the RTT
+} Flight;
+
+typedef struct {
+  int fd;                           //!< The panel connection, -1 if closed
+  int id;                           //!< Panel index, for the trace
+  OutQ out;                         //!< Bytes on their way to the panel
+  bool failed;                      //!< A write to the panel failed
+  unsigned char bufPanelIn[LNK_PANELBUF+2];  //!< Last decoded packet (length-prefixed)
+
+  unsigned char rx[LNK_RXBUF];      //!< Receive ring
+  int rxHead;                       //!< Oldest byte in the receive ring
+  int rxCount;                      //!< Bytes in the receive ring
+  long partialSince;                //!< When the pending partial frame started, -1 if none
+
+  unsigned char queue[LNK_QUEUE][LNK_PANELBUF+1]; //!< Commands waiting for credit
+  int queueHead;                    //!< Oldest queued command
+  int queueCount;                   //!< Number of queued commands
+
+  Flight flights[LNK_MAXWINDOW];    //!< Commands in flight (a ring)
+  int flightHead;                   //!< Oldest command in flight
+  int flightCount;                  //!< Number of commands in flight
+  int window;                       //!< Negotiated window
+  int speed;                        //!< Baud rate in use
+  bool slowOnce;                    //!< The last baud rate switch failed, skip it on the next open
+  long retryAt;                     //!< When the panel can be opened again (see link_retry())
+  unsigned long accepted;           //!< Commands accepted so far
+  unsigned long retired;            //!< Commands acked or lost so far
+  int lostRun;                      //!< Commands lost in a row
+
+  LinkHandler onInput;              //!< Called for non-ack packets
+  LinkHandler onLost;               //!< Called for commands never acked
+  void *ctx;                        //!< Passed to the callbacks
+
+  LinkStats stats;                  //!< Statistics
+} Link;
+
+// Public routines
+
+void link_setup(Link *l, int id, LinkHandler input, LinkHandler lost, void *ctx);
+bool link_open(Link *l, int fd, const SerialConfig *cfg);
+int link_retry(Link *l);
+void link_close(Link *l);
+bool link_dead(Link *l);
+bool link_send(Link *l, const unsigned char *pkt);
+bool link_busy(Link *l);
+int link_pending(Link *l);
+int link_window(Link *l);
+unsigned long link_mark(Link *l);
+bool link_reached(Link *l, unsigned long mark);
+bool link_input(Link *l);
+bool link_writing(Link *l);
+bool link_output(Link *l);
+int link_timeout(Link *l);
+void link_expire(Link *l);
+
+#endif
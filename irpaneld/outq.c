@@ -0,0 +1,232 @@
+/** @file
+ * Output queue library
+ *
+ * Buffers output for a non-blocking FD, so a slow reader never blocks the
+ * daemon. Everything put into a queue stays in a byte ring until
+ * outq_flush() gets it written, which takes a single writev() for the
+ * whole ring (two pieces when it wraps) unless the FD fills up. Whatever
+ * the FD did not take is left for the next flush, once it is writable.
+ *
+ * An I/O backend that writes asynchronously can instead take a copy of
+ * the queued bytes with outq_peek() and drop them with outq_drop() once
+ * written.
+ *
+ * Queues grow on demand up to OUTQ_MAX. What does not fit then is dropped
+ * and the queue is marked full, so the owner can give up on the reader.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "irpaneld.h"
+#include "outq.h"
+
+// Internal routines
+
+/** Make room in a queue
+ * Grows the ring, keeping the contents unwrapped to its start.
+ *
+ * @param q   The queue
+ * @param len Bytes that have to fit in addition
+ * @return False if that would exceed OUTQ_MAX
+ * @private
+ */
+static bool make_room(OutQ *q, int len) {
+  char *buf;
+  int size, first;
+
+  if (q->count + len <= q->size) return true;
+  if (q->count + len > OUTQ_MAX) return false;
+
+  size = q->size > 0 ? q->size : OUTQ_INITIAL;
+  while (size < q->count + len) size *= 2;
+  if (size > OUTQ_MAX) size = OUTQ_MAX;
+
+  if ((buf = malloc(size)) == NULL) {
+    warn("Can't grow output queue");
+    return false;
+  }
+
+  first = q->size - q->head;
+  if (first > q->count) first = q->count;
+  if (q->count > 0) {
+    memcpy(buf, q->buf + q->head, first);
+    memcpy(buf + first, q->buf, q->count - first);
+  }
+
+  free(q->buf);
+  q->buf = buf;
+  q->size = size;
+  q->head = 0;
+  return true;
+}
+
+// Public routines
+
+/** Setup an empty queue
+ * Nothing is allocated until something is put into it.
+ *
+ * @param q  The queue
+ * @param fd Where it drains to
+ */
+void outq_init(OutQ *q, int fd) {
+  q->fd = fd;
+  q->buf = NULL;
+  q->size = q->head = q->count = 0;
+  q->full = false;
+}
+
+/** Release a queue
+ * Whatever was not written yet is dropped.
+ *
+ * @param q The queue
+ */
+void outq_free(OutQ *q) {
+  free(q->buf);
+  outq_init(q, -1);
+}
+
+/** Append bytes to a queue
+ * Nothing is written until outq_flush().
+ *
+ * @param q    The queue
+ * @param data The bytes
+ * @param len  Number of bytes
+ * @return False if they did not fit (the queue is then marked full)
+ */
+bool outq_put(OutQ *q, const void *data, int len) {
+  int tail, first;
+
+  if (len <= 0) return true;
+  if (!make_room(q, len)) {
+    q->full = true;
+    return false;
+  }
+
+  tail = (q->head + q->count) % q->size;
+  first = q->size - tail;
+  if (first > len) first = len;
+  memcpy(q->buf + tail, data, first);
+  memcpy(q->buf, (const char *)data + first, len - first);
+  q->count += len;
+
+  return true;
+}
+
+/** Append formatted text to a queue
+ *
+ * @param q      The queue
+ * @param format As for printf
+ * @return False if it did not fit (the queue is then marked full)
+ */
+bool outq_printf(OutQ *q, const char *format, ...) {
+  char local[256], *text;
+  va_list args;
+  int len;
+  bool ok;
+
+  va_start(args, format);
+  len = vsnprintf(local, sizeof(local), format, args);
+  va_end(args);
+  if (len < 0) return false;
+  if (len < (int)sizeof(local)) return outq_put(q, local, len);
+
+  if ((text = malloc(len + 1)) == NULL) {
+    q->full = true;
+    return false;
+  }
+  va_start(args, format);
+  vsnprintf(text, len + 1, format, args);
+  va_end(args);
+
+  ok = outq_put(q, text, len);
+  free(text);
+  return ok;
+}
+
+/** Write out as much of a queue as the FD takes
+ * Never blocks.
+ *
+ * @param q The queue
+ * @return Bytes still queued, -1 on a write error
+ */
+int outq_flush(OutQ *q) {
+  struct iovec iov[2];
+  int first, n;
+  ssize_t count;
+
+  while (q->count > 0) {
+    first = q->size - q->head;
+    if (first > q->count) first = q->count;
+    iov[0].iov_base = q->buf + q->head;
+    iov[0].iov_len = first;
+    iov[1].iov_base = q->buf;
+    iov[1].iov_len = q->count - first;
+    n = (first < q->count) ? 2 : 1;
+
+    IO_CALL();
+    if ((count = writev(q->fd, iov, n)) < 0) {
+      if (errno == EINTR) {
+        errno = 0;
+        continue;
+      }
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        errno = 0;
+        break;
+      }
+      return -1;
+    }
+
+    q->head = (q->head + count) % q->size;
+    q->count -= count;
+  }
+
+  if (q->count == 0) q->head = 0;
+  return q->count;
+}
+
+/** Copy the oldest queued bytes
+ * They stay queued, see outq_drop().
+ *
+ * @param q    The queue
+ * @param data Where to copy them
+ * @param max  Most bytes to copy
+ * @return Bytes copied
+ */
+int outq_peek(const OutQ *q, void *data, int max) {
+  int n, first;
+
+  n = q->count < max ? q->count : max;
+  if (n == 0) return 0;
+
+  first = q->size - q->head;
+  if (first > n) first = n;
+  memcpy(data, q->buf + q->head, first);
+  memcpy((char *)data + first, q->buf, n - first);
+  return n;
+}
+
+/** Drop the oldest queued bytes
+ * For bytes written some other way than outq_flush().
+ *
+ * @param q The queue
+ * @param n Number of bytes
+ */
+void outq_drop(OutQ *q, int n) {
+  if (n > q->count) n = q->count;
+  if (n <= 0) return;
+
+  q->head = (q->head + n) % q->size;
+  q->count -= n;
+  if (q->count == 0) q->head = 0;
+}
@@ -0,0 +1,36 @@
+/** @file
+ * Output queue library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_OUTQ
+#define IRPD_OUTQ 1
+
+// Configurable defines
+
+#define OUTQ_INITIAL  1024    //!< Initial size of a queue
+#define OUTQ_MAX      262144  //!< Most bytes a queue will hold
+
+// Public types
+
+typedef struct {
+  int fd;                     //!< Where the queue drains to
+  char *buf;                  //!< Byte ring, NULL until first used
+  int size;                   //!< Ring size
+  int head;                   //!< Oldest byte in the ring
+  int count;                  //!< Bytes in the ring
+  bool full;                  //!< Something did not fit since the last outq_init()
+} OutQ;
+
+// Public routines
+
+void outq_init(OutQ *q, int fd);
+void outq_free(OutQ *q);
+bool outq_put(OutQ *q, const void *data, int len);
+bool outq_printf(OutQ *q, const char *format, ...);
+int outq_flush(OutQ *q);
+int outq_peek(const OutQ *q, void *data, int max);
+void outq_drop(OutQ *q, int n);
+
+#endif
@@ -0,0 +1,456 @@
+/** @file
+ * Panel relay library
+ *
+ * Runs a panel link (see link.c) on a thread of its own, so nothing
+ * the panel does (or fails to do) holds up the clients, or the other
+ * panels. The link thread owns the panel connection and its Link; the
+ * rest of the daemon only talks to it through two lock-free single-producer single-consumer
+ * queues (see spsc.c): commands go one way, panel input and lost commands
+ * come back the other, and are handed to the callbacks on the main
+ * thread by relay_events().
+ *
+ * Each queue has an eventfd as its doorbell. The producer only rings it
+ * when the consumer has not been rung since it last looked, so a whole
+ * plan of commands (or a burst of input) costs one wakeup.
+ *
+ * How far the panel got is published as a count of commands done (acked,
+ * lost or refused), which is what relay_mark() and relay_reached() go by.
+ * Acks alone only wake the main thread when it waits for them, that is
+ * for a mark it asked about.
+ *
+ * When the panel hangs up, or stops acking (see link_dead()), the link
+ * thread closes it and keeps trying to open the device again, dropping
+ * whatever commands come meanwhile (they count as done, so nobody waits
+ * on a dead panel). Once it is back the firmware is given RLY_SETTLE to
+ * drop any partial command, the window is negotiated again, and the main
+ * thread is told to repaint everything. Clients never notice, beyond the
+ * pause.
+ *
+ * The link statistics are updated by the link thread and read without
+ * locking, so a query may see them a moment out of date.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "hist.h"
+#include "irpaneld.h"
+#include "link.h"
+#include "relay.h"
+#include "serial.h"
+#include "spsc.h"
+#include "trace.h"
+
+// Internal defines
+
+#define EV_INPUT  0         //!< Event: packet from the panel
+#define EV_LOST   1         //!< Event: command never acked (or refused)
+#define EV_GONE   2         //!< Event: the link thread gave up
+#define EV_RESET  3         //!< Event: the panel is back after a hang-up
+
+// Internal routines
+
+/** Ring a doorbell unless it was rung already
+ *
+ * @param fd   The eventfd
+ * @param rung Its flag
+ * @private
+ */
+static void ring(int fd, bool *rung) {
+  uint64_t one = 1;
+
+  if (__atomic_exchange_n(rung, true, __ATOMIC_SEQ_CST)) return;
+  IO_CALL();
+  if (write(fd, &one, sizeof(one)) != sizeof(one))
+    errno = 0;
+}
+
+/** Answer a doorbell
+ * Has to come before looking at the queue, see ring().
+ *
+ * @param fd   The eventfd
+ * @param rung Its flag
+ * @private
+ */
+static void answer(int fd, bool *rung) {
+  uint64_t count;
+
+  __atomic_store_n(rung, false, __ATOMIC_SEQ_CST);
+  IO_CALL();
+  if (read(fd, &count, sizeof(count)) != sizeof(count))
+    errno = 0;
+}
+
+/** Queue an event for the main thread
+ * Events are never dropped, with the queue full this waits for room.
+ *
+ * @param r    The relay
+ * @param type Event type
+ * @param pkt  The packet (length-prefixed), NULL for none
+ * @private
+ */
+static void post(Relay *r, unsigned char type, const unsigned char *pkt) {
+  unsigned char ev[SPSC_SLOT];
+  int len = 1;
+
+  ev[0] = type;
+  if (pkt != NULL) {
+    memcpy(ev + 1, pkt, pkt[0]+1);
+    len += pkt[0]+1;
+  }
+
+  while (!spsc_push(&r->events, ev, len)) {
+    ring(r->fdEvents, &r->eventsRung);
+    if (__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) return;
+    usleep(RLY_FULLWAIT);
+  }
+}
+
+/** Link callback for panel input
+ *
+ * @param ctx The relay
+ * @param pkt The packet (length-prefixed)
+ * @private
+ */
+static void post_input(void *ctx, const unsigned char *pkt) {
+  post(ctx, EV_INPUT, pkt);
+}
+
+/** Link callback for lost commands
+ *
+ * @param ctx The relay
+ * @param pkt The packet (length-prefixed)
+ * @private
+ */
+static void post_lost(void *ctx, const unsigned char *pkt) {
+  post(ctx, EV_LOST, pkt);
+}
+
+/** Hand the queued commands to the link
+ * Link thread.
+ *
+ * @param r The relay
+ * @private
+ */
+static void take(Relay *r) {
+  unsigned char pkt[SPSC_SLOT];
+
+  while (spsc_pop(&r->cmds, pkt)) {
+    r->taken++;
+    if (!link_send(&r->link, pkt))
+      post(r, EV_LOST, pkt);
+  }
+}
+
+/** Drop the queued commands
+ * Link thread, with the panel closed.
+ *
+ * @param r The relay
+ * @private
+ */
+static void drop(Relay *r) {
+  unsigned char pkt[SPSC_SLOT];
+
+  while (spsc_pop(&r->cmds, pkt)) {
+    r->taken++;
+    STAT_ADD(r->link.stats.dropped, 1);
+  }
+}
+
+/** Publish the link progress
+ * Link thread. Wakes the main thread if there is anything new for it.
+ *
+ * @param r The relay
+ * @private
+ */
+static void publish(Relay *r) {
+  unsigned long now, want;
+  bool wake;
+
+  now = r->taken - link_pending(&r->link);
+  __atomic_store_n(&r->done, now, __ATOMIC_SEQ_CST);
+
+  wake = !spsc_empty(&r->events);
+  want = __atomic_load_n(&r->wantDone, __ATOMIC_SEQ_CST);
+  if ((want > 0) && (now >= want) &&
+      __atomic_compare_exchange_n(&r->wantDone, &want, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    wake = true;
+
+  if (wake) ring(r->fdEvents, &r->eventsRung);
+}
+
+/** Open the panel again after it went away
+ * Link thread. Keeps trying every RLY_RETRY (or later, see link_retry())
+ * until it works, or the relay is stopped.
+ *
+ * @param r The relay
+ * @return False if stopped meanwhile
+ * @private
+ */
+static bool reopen(Relay *r) {
+  struct pollfd pfd;
+  unsigned char window;
+  int fd, wait;
+
+  note("Panel %s gone, reopening", r->device);
+  trace_add(TRC_REOPEN, r->link.id, NULL, 0);
+  trace_trigger();
+  link_close(&r->link);
+
+  pfd.fd = r->fdCmds;
+  pfd.events = POLLIN;
+  while (true) {
+    drop(r);
+    publish(r);
+    if (__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST)) return false;
+
+    if ((link_retry(&r->link) == 0) && ((fd = serial_open(r->device, &r->cfg)) >= 0)) {
+      usleep(RLY_SETTLE * 1000);
+      if (link_open(&r->link, fd, &r->cfg)) break;
+      link_close(&r->link);
+    }
+    errno = 0;
+
+    if ((wait = link_retry(&r->link)) < RLY_RETRY) wait = RLY_RETRY;
+    IO_CALL();
+    if ((poll(&pfd, 1, wait) > 0) && (pfd.revents & POLLIN))
+      answer(r->fdCmds, &r->cmdsRung);
+    errno = 0;
+  }
+
+  drop(r);
+  STAT_ADD(r->link.stats.reopens, 1);
+  window = link_window(&r->link);
+  trace_add(TRC_BACK, r->link.id, &window, sizeof(window));
+  note("Panel %s back", r->device);
+  post(r, EV_RESET, NULL);
+  publish(r);
+
+  return true;
+}
+
+/** The link thread
+ *
+ * @param arg The relay
+ * @return NULL
+ * @private
+ */
+static void *run(void *arg) {
+  Relay *r = arg;
+  struct pollfd pfd[2];
+  bool ok;
+
+  pfd[1].fd = r->fdCmds;
+  pfd[1].events = POLLIN;
+
+  // a failed baud rate switch at setup, the panel needs time (see link_open())
+  if ((link_retry(&r->link) > 0) && !reopen(r)) return NULL;
+
+  while (!__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST)) {
+    pfd[0].fd = r->link.fd;
+    pfd[0].events = link_writing(&r->link) ? POLLIN | POLLOUT : POLLIN;
+
+    IO_CALL();
+    if (poll(pfd, 2, link_timeout(&r->link)) < 0) {
+      if (errno == EINTR) {
+        errno = 0;
+        continue;
+      }
+      warn("Error polling the panel");
+      break;
+    }
+
+    link_expire(&r->link);
+    if (pfd[1].revents & POLLIN) {
+      answer(r->fdCmds, &r->cmdsRung);
+      take(r);
+    }
+
+    ok = !(pfd[0].revents & (POLLHUP | POLLERR)) &&
+      (!(pfd[0].revents & POLLOUT) || link_output(&r->link)) &&
+      (!(pfd[0].revents & POLLIN) || link_input(&r->link));
+    publish(r);
+    if ((!ok || link_dead(&r->link)) && !reopen(r)) break;
+  }
+
+  if (!__atomic_load_n(&r->stop, __ATOMIC_SEQ_CST)) {
+    post(r, EV_GONE, NULL);
+    ring(r->fdEvents, &r->eventsRung);
+  }
+
+  return NULL;
+}
+
+// Public routines
+
+/** Open the panel and start the link thread
+ * Will die if the panel can not be opened. The window is negotiated
+ * before the thread starts (see link_open()), unless a failed baud rate
+ * switch leaves that to the thread.
+ *
+ * @param r      The relay
+ * @param device Path to the panel device (has to outlive the relay)
+ * @param cfg    Its serial config
+ * @param id     Panel index, for the trace
+ * @param input  Called with every packet that is not an ack
+ * @param lost   Called with every command that was not acked
+ * @param reset  Called when the panel is back after a hang-up
+ * @param ctx    Passed to the callbacks
+ */
+void relay_setup(Relay *r, const char *device, const SerialConfig *cfg, int id,
+    LinkHandler input, LinkHandler lost, RelayHandler reset, void *ctx) {
+  sigset_t all, old;
+  int fd;
+
+  r->onInput = input;
+  r->onLost = lost;
+  r->onReset = reset;
+  r->ctx = ctx;
+  r->device = device;
+  r->cfg = *cfg;
+  spsc_init(&r->cmds);
+  spsc_init(&r->events);
+  r->cmdsRung = r->eventsRung = r->stop = false;
+  r->sent = r->taken = r->done = r->wantDone = 0;
+
+  if (((r->fdCmds = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) ||
+      ((r->fdEvents = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0))
+    die("Can't create relay eventfd");
+
+  if ((fd = serial_open(device, cfg)) < 0)
+    die("Can't open serial port device");
+  link_setup(&r->link, id, post_input, post_lost, r);
+  link_open(&r->link, fd, &r->cfg);
+
+  // signals are for the main thread
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if ((errno = pthread_create(&r->thread, NULL, run, r)) != 0)
+    die("Can't start the link thread");
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  r->started = true;
+}
+
+/** FD that becomes readable when there are events to handle
+ * See relay_events().
+ *
+ * @param r The relay
+ * @return The FD
+ */
+int relay_fd(Relay *r) {
+  return r->fdEvents;
+}
+
+/** Handle the events from the link thread
+ * Call when relay_fd() is readable. The callbacks run from here.
+ *
+ * @param r The relay
+ * @return False if the link thread gave up
+ */
+bool relay_events(Relay *r) {
+  unsigned char ev[SPSC_SLOT];
+
+  answer(r->fdEvents, &r->eventsRung);
+  while (spsc_pop(&r->events, ev)) {
+    switch (ev[0]) {
+      case EV_INPUT:
+        r->onInput(r->ctx, ev + 1);
+        break;
+
+      case EV_LOST:
+        r->onLost(r->ctx, ev + 1);
+        break;
+
+      case EV_RESET:
+        r->onReset(r->ctx);
+        break;
+
+      case EV_GONE:
+        return false;
+    }
+  }
+
+  return true;
+}
+
+/** Send a command to the panel
+ * Never blocks.
+ *
+ * @param r   The relay
+ * @param pkt The packet (length-prefixed)
+ * @return True if queued, false if the queue is full
+ */
+bool relay_send(Relay *r, const unsigned char *pkt) {
+  if (!spsc_push(&r->cmds, pkt, pkt[0]+1)) {
+    warn("Relay queue full");
+    STAT_ADD(r->link.stats.refused, 1);
+    return false;
+  }
+
+  r->sent++;
+  ring(r->fdCmds, &r->cmdsRung);
+  return true;
+}
+
+/** Mark the commands sent so far
+ *
+ * @param r The relay
+ * @return The mark, see relay_reached()
+ */
+unsigned long relay_mark(Relay *r) {
+  return r->sent;
+}
+
+/** Check whether the panel is done with everything before a mark
+ * Lost commands count as done. If not done, relay_fd() becomes readable
+ * once it is.
+ *
+ * @param r    The relay
+ * @param mark The mark
+ * @return True if done
+ */
+bool relay_reached(Relay *r, unsigned long mark) {
+  unsigned long want;
+
+  if (__atomic_load_n(&r->done, __ATOMIC_SEQ_CST) >= mark) return true;
+
+  want = __atomic_load_n(&r->wantDone, __ATOMIC_SEQ_CST);
+  while (((want == 0) || (mark < want)) &&
+      !__atomic_compare_exchange_n(&r->wantDone, &want, mark, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+    ;
+
+  // the link thread may have got there in the meantime, look again
+  return __atomic_load_n(&r->done, __ATOMIC_SEQ_CST) >= mark;
+}
+
+/** Stop the link thread and release resources
+ * The panel is closed too.
+ *
+ * @param r The relay
+ */
+void relay_shutdown(Relay *r) {
+  if (r->started) {
+    __atomic_store_n(&r->stop, true, __ATOMIC_SEQ_CST);
+    ring(r->fdCmds, &r->cmdsRung);
+    pthread_join(r->thread, NULL);
+    r->started = false;
+  }
+
+  link_close(&r->link);
+  if (r->fdCmds >= 0) close(r->fdCmds);
+  if (r->fdEvents >= 0) close(r->fdEvents);
+  r->fdCmds = r->fdEvents = -1;
+}
@@ -0,0 +1,64 @@
+/** @file
+ * Panel relay library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_RELAY
+#define IRPD_RELAY 1
+
+#include <pthread.h>
+
+#include "link.h"
+#include "serial.h"
+#include "spsc.h"
+
+// Configurable defines
+
+#define RLY_FULLWAIT  1000  //!< Microseconds between retries with the event queue full
+#define RLY_RETRY     200   //!< Milliseconds between attempts to reopen a panel
+#define RLY_SETTLE    150   //!< Milliseconds the firmware gets to drop a partial command (see CLI_STALE)
+
+// Public types
+
+typedef void (*RelayHandler)(void *ctx); //!< Event callback
+
+typedef struct {
+  Spsc cmds;                        //!< Commands, main thread to link thread
+  Spsc events;                      //!< Events, link thread to main thread
+  int fdCmds;                       //!< Doorbell of cmds
+  int fdEvents;                     //!< Doorbell of events
+  bool cmdsRung;                    //!< fdCmds rung since the link thread looked
+  bool eventsRung;                  //!< fdEvents rung since the main thread looked
+  pthread_t thread;                 //!< The link thread
+  bool started;                     //!< The link thread runs
+  bool stop;                        //!< Asks the link thread to quit
+
+  unsigned long sent;               //!< Commands queued (main thread)
+  unsigned long taken;              //!< Commands taken from the queue (link thread)
+  unsigned long done;               //!< Commands done, published by the link thread
+  unsigned long wantDone;           //!< Wake the main thread once done gets here, 0 for never
+
+  LinkHandler onInput;              //!< Called for non-ack packets
+  LinkHandler onLost;               //!< Called for commands never acked
+  RelayHandler onReset;             //!< Called when the panel is back after a hang-up
+  void *ctx;                        //!< Passed to the callbacks
+
+  const char *device;               //!< Panel device, to reopen it
+  SerialConfig cfg;                 //!< Its serial config
+
+  Link link;                        //!< The link, owned by the link thread
+} Relay;
+
+// Public routines
+
+void relay_setup(Relay *r, const char *device, const SerialConfig *cfg, int id,
+    LinkHandler input, LinkHandler lost, RelayHandler reset, void *ctx);
+int relay_fd(Relay *r);
+bool relay_events(Relay *r);
+bool relay_send(Relay *r, const unsigned char *pkt);
+unsigned long relay_mark(Relay *r);
+bool relay_reached(Relay *r, unsigned long mark);
+void relay_shutdown(Relay *r);
+
+#endif
@@ -0,0 +1,96 @@
+/** @file
+ * Panel link scheduler library
+ *
+ * Decides whose changes go to the panel next. At 9600 baud the link is
+ * the bottleneck, so rather than sending changes in the order they were
+ * made, the link is fed one packet at a time and every packet goes to
+ * whoever the scheduler picks.
+ *
+ * Flows (clients, basically) belong to a class each time they are
+ * considered. Classes have strict priority: a flow of a lower class is
+ * only picked when no flow of a higher class has anything to send.
+ * Within a class flows share the link by deficit round robin: on every
+ * round each flow with something to send is credited SCH_QUANTUM bytes
+ * per unit of weight, and is served until its credit is spent. Packet
+ * sizes are only known once sent, so a flow may overdraw by a packet,
+ * which comes out of its next round.
+ *
+ * Each panel link is scheduled on its own, with a Sched of its own.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+
+#include "sched.h"
+
+// Public routines
+
+/** Reset a flow
+ *
+ * @param s      The scheduler
+ * @param flow   The flow
+ * @param weight Its share of the link (0 to SCH_MAXWEIGHT), 0 puts it in
+ *               the background class
+ */
+void sched_reset(Sched *s, int flow, int weight) {
+  s->flows[flow].weight = weight;
+  s->flows[flow].deficit = 0;
+}
+
+/** Pick the flow to send the next packet
+ *
+ * @param s     The scheduler
+ * @param cls   Class of every flow, -1 for those with nothing to send
+ * @param count Number of flows
+ * @return The flow, -1 if none has anything to send
+ */
+int sched_pick(Sched *s, const int *cls, int count) {
+  int c, i, f, w;
+  bool any;
+
+  for (c = 0; c < SCH_CLASSES; c++) {
+    any = false;
+    for (i = 0; i < count; i++)
+      if (cls[i] == c) any = true;
+      else if (cls[i] < 0) s->flows[i].deficit = 0; // idle flows keep no credit
+    if (!any) continue;
+
+    // credit the class until someone can go, a flow that overdrew by
+    // a big packet may need a few rounds
+    while (true) {
+      for (i = 0; i < count; i++) {
+        f = (s->next[c] + i) % count;
+        if ((cls[f] == c) && (s->flows[f].deficit > 0)) {
+          s->next[c] = f;
+          s->flows[f].cls = c;
+          return f;
+        }
+      }
+
+      for (f = 0; f < count; f++)
+        if (cls[f] == c) {
+          w = s->flows[f].weight > 0 ? s->flows[f].weight : 1;
+          s->flows[f].deficit += w * SCH_QUANTUM;
+        }
+    }
+  }
+
+  return -1;
+}
+
+/** Account for a packet sent for a flow
+ * Moves on to the next flow once this one spent its credit.
+ *
+ * @param s     The scheduler
+ * @param flow  The flow (as picked)
+ * @param bytes Bytes sent
+ */
+void sched_charge(Sched *s, int flow, int bytes) {
+  int c = s->flows[flow].cls;
+
+  s->bytes[c] += bytes;
+  s->flows[flow].deficit -= bytes;
+  if (s->flows[flow].deficit <= 0)
+    s->next[c] = flow + 1;
+}
@@ -0,0 +1,45 @@
+/** @file
+ * Panel link scheduler library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_SCHED
+#define IRPD_SCHED 1
+
+// Configurable defines
+
+#define SCH_FLOWS     32    //!< Most flows
+#define SCH_QUANTUM   24    //!< Bytes per round for a flow of weight 1 (a print packet)
+#define SCH_MAXWEIGHT 16    //!< Largest flow weight
+#define SCH_AHEAD     1     //!< Packets kept queued beyond the link window
+#define SCH_RECENT    1000  //!< Milliseconds a client stays interactive after a key
+
+// Public types
+
+typedef enum {
+  SCH_INTERACTIVE,            //!< Feedback to the user pressing keys
+  SCH_NORMAL,                 //!< Ordinary updates
+  SCH_BACKGROUND,             //!< Only when nothing else wants the link
+  SCH_CLASSES                 //!< Number of classes
+} SchedClass;
+
+#define SCH_NAMES { "interactive", "normal", "background" } //!< By class
+
+typedef struct {
+  struct {
+    int weight;               //!< Share of the link, 0 for background
+    int deficit;              //!< Bytes it may still send this round
+    int cls;                  //!< Class it was last picked in
+  } flows[SCH_FLOWS];
+  int next[SCH_CLASSES];      //!< Flow to look at first, by class
+  unsigned long bytes[SCH_CLASSES]; //!< Bytes sent so far, by class
+} Sched;
+
+// Public routines
+
+void sched_reset(Sched *s, int flow, int weight);
+int sched_pick(Sched *s, const int *cls, int count);
+void sched_charge(Sched *s, int flow, int bytes);
+
+#endif
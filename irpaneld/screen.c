@@ -0,0 +1,442 @@
+/** @file
+ * Screen library
+ *
+ * Keeps a shadow framebuffer of the LCD and plans the cheapest packet
+ * sequence that brings the panel up to date with it.
+ *
+ * Each panel has a Display, holding what the panel should be showing, a
+ * model of what it does show and the cell order of its geometry (any
+ * part of the SCR_CHARS by SCR_LINES maximum, from the top left).
+ *
+ * Writes only change the wanted state and mark cells dirty. The planner walks the
+ * cells in DDRAM address order, so it can rely on the HD44780 address
+ * auto-increment (which also carries line 0 into line 2, and line 1 into
+ * line 3), skips cells the panel already shows, bridges short gaps instead
+ * of paying for another goto, and considers a clear when it is cheaper.
+ *
+ * Clients draw on their own screens, each one a window onto some part of
+ * the panel. screen_compose() flattens a stack of them into the display,
+ * marking only the cells that actually change, and notes which screen
+ * each cell came from. A plan can be limited to some of the cells, so
+ * the caller can decide whose changes go first (see sched.c).
+ *
+ * The panel model is updated when a packet is handed to the link, so a plan
+ * always starts from what the panel will show once everything in flight is
+ * done. Lost packets make the panel contents unknown again.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+
+#include "common.h"
+#include "screen.h"
+
+// Internal defines
+
+#define COST_GOTO   4     //!< Bytes in a goto packet
+#define COST_PRINT  2     //!< Bytes in a print packet header
+#define COST_CLEAR  2     //!< Bytes in a clear packet
+#define UNKNOWN     0     //!< Panel cell contents unknown
+#define NUL_ALIAS   0x08  //!< CGRAM glyph 0 is also reachable as 8
+
+// Internal variables
+
+static const unsigned char rowAddr[SCR_LINES] = SCR_ROWADDR;
+
+static char spaces[SCR_SIZE];   //!< A cleared panel
+
+// Internal routines
+
+/** DDRAM address of a cell
+ *
+ * @param cell The cell index
+ * @return The address
+ * @private
+ */
+static int addr_of(int cell) {
+  return rowAddr[cell / SCR_CHARS] + (cell % SCR_CHARS);
+}
+
+/** Check whether a cell has to be sent
+ *
+ * @param d    The display
+ * @param base What the panel shows (or will show)
+ * @param all  If false only dirty cells are considered
+ * @param cell The cell index
+ * @return True if the cell has to be sent
+ * @private
+ */
+static bool needed(Display *d, const char *base, bool all, int cell) {
+  return (all || d->lcd.dirty[cell]) && (d->lcd.buf[cell] != base[cell]);
+}
+
+/** Check whether a cell has to be sent in this plan
+ *
+ * @param d    The display
+ * @param base What the panel shows (or will show)
+ * @param all  If false only dirty cells are considered
+ * @param mask Cells to plan for, NULL for all
+ * @param cell The cell index
+ * @return True if the cell has to be sent
+ * @private
+ */
+static bool wanted(Display *d, const char *base, bool all, const bool *mask, int cell) {
+  return ((mask == NULL) || mask[cell]) && needed(d, base, all, cell);
+}
+
+/** Plan the packets for the text
+ * Packets are appended to out as length-prefixed frames.
+ *
+ * Runs are started on cells in mask only, but may bridge any cell.
+ *
+ * @param d    The display
+ * @param base What the panel shows (or will show)
+ * @param all  If false only dirty cells are considered
+ * @param mask Cells to plan for, NULL for all
+ * @param addr Current panel address, -1 if unknown
+ * @param out  Where to put the packets
+ * @param size Space available in out
+ * @return Bytes used, -1 if out of space
+ * @private
+ */
+static int plan_text(Display *d, const char *base, bool all, const bool *mask, int addr,
+    unsigned char *out, int size) {
+  int pos, start, end, next, gap, k, n;
+
+  pos = 0;
+  for (k = 0; k < d->count; k = end + 1) {
+    while ((k < d->count) && !wanted(d, base, all, mask, d->order[k])) k++;
+    if (k == d->count) break;
+
+    // extend the run over gaps that are cheaper to rewrite than to skip
+    start = end = k;
+    for (next = end + 1; next < d->count; next++) {
+      if (addr_of(d->order[next]) != addr_of(d->order[next-1]) + 1) break;
+      if (wanted(d, base, all, mask, d->order[next])) end = next;
+      else if ((next - end) >= (COST_GOTO + COST_PRINT)) break;
+    }
+
+    // the same goes for the stretch between the cursor and the run
+    if ((addr >= 0) && (addr < SCR_MAXADDR) && (d->cellAt[addr] >= 0)) {
+      for (n = 0; d->order[n] != d->cellAt[addr]; n++);
+      gap = start - n;
+      if ((gap > 0) && (gap < COST_GOTO) &&
+          (addr_of(d->order[start]) - addr == gap))
+        start = n;
+    }
+
+    if (addr != addr_of(d->order[start])) {
+      if (pos + COST_GOTO > size) return -1;
+      out[pos++] = 3;
+      out[pos++] = 'g';
+      out[pos++] = d->order[start] % SCR_CHARS;
+      out[pos++] = d->order[start] / SCR_CHARS;
+    }
+
+    while (start <= end) {
+      n = end - start + 1;
+      if (n > SCR_MAXRUN) n = SCR_MAXRUN;
+      if (pos + COST_PRINT + n > size) return -1;
+      out[pos++] = n + 1;
+      out[pos++] = 'p';
+      for (; n > 0; n--)
+        out[pos++] = d->lcd.buf[d->order[start++]];
+    }
+
+    addr = addr_of(d->order[end]) + 1;
+  }
+
+  return pos;
+}
+
+// Public routines
+
+/** Setup a display
+ * The panel contents are assumed unknown.
+ *
+ * @param d     The display
+ * @param cols  Panel width in chars, up to SCR_CHARS
+ * @param lines Panel height in lines, up to SCR_LINES
+ */
+void screen_init(Display *d, int cols, int lines) {
+  int i, j, t;
+
+  d->count = 0;
+  for (i = 0; i < SCR_MAXADDR; i++)
+    d->cellAt[i] = -1;
+  for (i = 0; i < SCR_SIZE; i++)
+    if ((i % SCR_CHARS < cols) && (i / SCR_CHARS < lines)) {
+      d->order[d->count++] = i;
+      d->cellAt[addr_of(i)] = i;
+    }
+  for (i = 1; i < d->count; i++)
+    for (j = i; (j > 0) && (addr_of(d->order[j-1]) > addr_of(d->order[j])); j--) {
+      t = d->order[j];
+      d->order[j] = d->order[j-1];
+      d->order[j-1] = t;
+    }
+  memset(&spaces, ' ', SCR_SIZE);
+
+  bzero(&d->lcd, sizeof(d->lcd));
+  memset(&d->lcd.buf, ' ', SCR_SIZE);
+  d->lcd.dim = SCR_DIM;
+  d->lcd.w = cols;
+  d->lcd.h = lines;
+
+  screen_invalidate(d);
+}
+
+/** Forget everything known about the panel
+ * The next plan will repaint it from scratch.
+ *
+ * @param d The display
+ */
+void screen_invalidate(Display *d) {
+  unsigned char pkt[2] = {1, 'c'};
+
+  screen_lost(d, pkt);
+  d->panel.dim = -1;
+}
+
+/** Set a cell, marking it dirty if it changes
+ *
+ * @param s    The screen
+ * @param cell The cell index
+ * @param ch   The character
+ * @private
+ */
+static void set_cell(Screen *s, int cell, char ch) {
+  if (s->buf[cell] != ch) {
+    s->buf[cell] = ch;
+    s->dirty[cell] = true;
+  }
+}
+
+/** Clear a screen
+ * Fills it with spaces and homes the cursor.
+ *
+ * @param s The screen
+ */
+void screen_clear(Screen *s) {
+  int x, y;
+
+  for (y = 0; y < s->h; y++)
+    for (x = 0; x < s->w; x++)
+      set_cell(s, y * SCR_CHARS + x, ' ');
+  s->x = s->y = 0;
+}
+
+/** Write characters at the cursor
+ * Past the end of a line the cursor moves to the start of the next one,
+ * and from the last line back to the first.
+ *
+ * @param s    The screen
+ * @param data The characters
+ * @param len  Number of characters
+ */
+void screen_write(Screen *s, const char *data, int len) {
+  char ch;
+
+  for (; len > 0; len--) {
+    ch = *data++;
+    if (ch == 0) ch = NUL_ALIAS;
+
+    set_cell(s, s->y * SCR_CHARS + s->x, ch);
+
+    if (++s->x >= s->w) {
+      s->x = 0;
+      if (++s->y >= s->h) s->y = 0;
+    }
+  }
+}
+
+/** Move and resize the window of a screen
+ * Contents are kept, anything newly exposed is blank. The cursor is homed.
+ * The window has to fit the panel.
+ *
+ * @param s    The screen
+ * @param left Window column on the panel
+ * @param top  Window line on the panel
+ * @param w    Width in chars
+ * @param h    Height in lines
+ */
+void screen_resize(Screen *s, int left, int top, int w, int h) {
+  int x, y;
+
+  for (y = 0; y < h; y++)
+    for (x = 0; x < w; x++)
+      if ((x >= s->w) || (y >= s->h))
+        set_cell(s, y * SCR_CHARS + x, ' ');
+
+  s->left = left;
+  s->top = top;
+  s->w = w;
+  s->h = h;
+  s->x = s->y = 0;
+}
+
+/** Flatten a stack of screens into a display
+ * Each panel cell shows the topmost screen whose window covers it, or a
+ * space if there is none. The topmost screen also sets the dim value.
+ * With an empty stack the display is left as it is.
+ *
+ * @param d     The display
+ * @param stack The screens, bottom first
+ * @param count Number of screens
+ * @param owner Where to put the index in stack each cell comes from (-1
+ *              for none), NULL if not needed
+ */
+void screen_compose(Display *d, Screen **stack, int count, int *owner) {
+  Screen *s;
+  int x, y, i;
+  char ch;
+
+  if (owner != NULL)
+    for (i = 0; i < SCR_SIZE; i++) owner[i] = -1;
+  if (count == 0) return;
+
+  for (y = 0; y < d->lcd.h; y++)
+    for (x = 0; x < d->lcd.w; x++) {
+      ch = ' ';
+      for (i = count - 1; i >= 0; i--) {
+        s = stack[i];
+        if ((x >= s->left) && (x < s->left + s->w) &&
+            (y >= s->top) && (y < s->top + s->h)) {
+          ch = s->buf[(y - s->top) * SCR_CHARS + (x - s->left)];
+          break;
+        }
+      }
+      set_cell(&d->lcd, y * SCR_CHARS + x, ch);
+      if (owner != NULL) owner[y * SCR_CHARS + x] = i;
+    }
+
+  d->lcd.dim = stack[count - 1]->dim;
+}
+
+/** Check whether a cell differs from what the panel will show
+ *
+ * @param d    The display
+ * @param cell The cell index
+ * @return True if it has to be sent
+ */
+bool screen_pending(Display *d, int cell) {
+  return (d->cellAt[addr_of(cell)] == cell) && needed(d, d->panel.buf, false, cell);
+}
+
+/** Check whether the dim value differs from the panel's
+ *
+ * @param d The display
+ * @return True if it has to be sent
+ */
+bool screen_dim_pending(Display *d) {
+  return d->panel.dim != d->lcd.dim;
+}
+
+/** Plan packets to bring the panel up to date with its display
+ * Packets are put into out as length-prefixed frames, ready to be sent
+ * one after the other. Nothing is planned if the panel is up to date.
+ * A pending dim change always comes first. A plan limited to some cells
+ * never clears the panel.
+ *
+ * @param d    The display
+ * @param out  Where to put the packets
+ * @param size Space available in out
+ * @param mask Cells to plan for, NULL for all
+ * @return Bytes used
+ */
+int screen_plan(Display *d, unsigned char *out, int size, const bool *mask) {
+  unsigned char alt[SCR_PLANBUF];
+  int pos, len, altLen;
+
+  pos = 0;
+  if (d->panel.dim != d->lcd.dim) {
+    out[pos++] = 2;
+    out[pos++] = 'd';
+    out[pos++] = d->lcd.dim;
+  }
+
+  len = plan_text(d, d->panel.buf, false, mask, d->panel.addr, out + pos, size - pos);
+  altLen = (mask == NULL) ? plan_text(d, spaces, true, NULL, 0, alt, sizeof(alt)) : -1;
+
+  if ((altLen >= 0) && ((len < 0) || (altLen + COST_CLEAR < len)) &&
+      (pos + COST_CLEAR + altLen <= size)) {
+    dbg(printf("PLAN: clear + %d bytes (instead of %d)\n", altLen, len));
+    out[pos++] = 1;
+    out[pos++] = 'c';
+    memcpy(out + pos, alt, altLen);
+    len = altLen;
+  }
+
+  if (len < 0) {
+    warn("Plan does not fit the buffer");
+    return pos;
+  }
+
+  return pos + len;
+}
+
+/** Update the panel model for a packet handed to the panel
+ *
+ * @param d   The display
+ * @param pkt The packet (length-prefixed)
+ */
+void screen_sent(Display *d, const unsigned char *pkt) {
+  int cell, i;
+
+  switch (pkt[1]) {
+    case 'c':
+      memcpy(&d->panel.buf, &spaces, SCR_SIZE);
+      d->panel.addr = 0;
+      for (i = 0; i < SCR_SIZE; i++)
+        d->lcd.dirty[i] = (d->lcd.buf[i] != ' ');
+      break;
+
+    case 'd':
+      d->panel.dim = pkt[2];
+      break;
+
+    case 'g':
+      d->panel.addr = rowAddr[pkt[3]] + pkt[2];
+      break;
+
+    case 'h':
+      d->panel.addr = 0;
+      break;
+
+    case 'p':
+      for (i = 2; i <= pkt[0]; i++, d->panel.addr++)
+        if ((d->panel.addr >= 0) && (d->panel.addr < SCR_MAXADDR) &&
+            ((cell = d->cellAt[d->panel.addr]) >= 0)) {
+          d->panel.buf[cell] = pkt[i];
+          d->lcd.dirty[cell] = (d->lcd.buf[cell] != (char)pkt[i]);
+        }
+      break;
+  }
+}
+
+/** Update the panel model for a packet that may not have been executed
+ * A lost print or goto leaves the whole text unknown, as the address it
+ * was meant for may be stale by now. Only cells on the panel are marked
+ * dirty, the rest could never be sent.
+ *
+ * @param d   The display
+ * @param pkt The packet (length-prefixed)
+ */
+void screen_lost(Display *d, const unsigned char *pkt) {
+  int i;
+
+  if (pkt[1] == 'd') {
+    d->panel.dim = -1;
+    return;
+  }
+
+  memset(&d->panel.buf, UNKNOWN, SCR_SIZE);
+  d->panel.addr = -1;
+  for (i = 0; i < d->count; i++)
+    d->lcd.dirty[d->order[i]] = true;
+}
@@ -0,0 +1,64 @@
+/** @file
+ * Screen library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_SCREEN
+#define IRPD_SCREEN 1
+
+// Configurable defines
+
+#define SCR_LINES     4     //!< LCD height in lines
+#define SCR_CHARS     20    //!< LCD width in chars/bytes
+#define SCR_ROWADDR   {0x00, 0x40, 0x14, 0x54} //!< DDRAM address of each line (see lcd_goto)
+#define SCR_MAXRUN    22    //!< Most chars in one print packet (firmware CLI_BUFSIZ less 2)
+#define SCR_PLANBUF   512   //!< Space for a planned packet sequence
+#define SCR_DIM       128   //!< Initial dim value
+
+// Public defines
+
+#define SCR_SIZE      (SCR_LINES*SCR_CHARS) //!< LCD size in chars/bytes
+#define SCR_MAXADDR   0x80  //!< DDRAM address space (7 bits)
+
+// Public types and variables
+
+typedef struct {
+  unsigned char x;          //!< Cursor column
+  unsigned char y;          //!< Cursor line
+  unsigned char dim;        //!< Backlight PWM value
+  unsigned char left;       //!< Window column on the panel
+  unsigned char top;        //!< Window line on the panel
+  unsigned char w;          //!< Width in chars
+  unsigned char h;          //!< Height in lines
+  char buf[SCR_SIZE];       //!< Cell contents, line by line (SCR_CHARS apart)
+  bool dirty[SCR_SIZE];     //!< Cells changed since last sent to the panel
+} Screen;
+
+typedef struct {
+  Screen lcd;               //!< What the panel should be showing
+  int count;                //!< Cells on the panel
+  int order[SCR_SIZE];      //!< Its cell indexes sorted by DDRAM address
+  int cellAt[SCR_MAXADDR];  //!< Cell index at DDRAM address, -1 if none
+  struct {
+    char buf[SCR_SIZE];     //!< What the panel shows (UNKNOWN if not sure)
+    int dim;                //!< Panel dim value, -1 if unknown
+    int addr;               //!< Panel DDRAM address, -1 if unknown
+  } panel;                  //!< Model of the physical panel
+} Display;
+
+// Public routines
+
+void screen_init(Display *d, int cols, int lines);
+void screen_invalidate(Display *d);
+void screen_clear(Screen *s);
+void screen_write(Screen *s, const char *data, int len);
+void screen_resize(Screen *s, int left, int top, int w, int h);
+void screen_compose(Display *d, Screen **stack, int count, int *owner);
+bool screen_pending(Display *d, int cell);
+bool screen_dim_pending(Display *d);
+int screen_plan(Display *d, unsigned char *out, int size, const bool *mask);
+void screen_sent(Display *d, const unsigned char *pkt);
+void screen_lost(Display *d, const unsigned char *pkt);
+
+#endif
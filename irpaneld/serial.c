@@ -1,7 +1,10 @@
 /** @file
  * Serial library
  *
- * Basic code to setup the serial port.
+ * Basic code to open and setup the serial port.
+ *
+ * Uses the Linux termios2 interface, so any baud rate the hardware can
+ * do will work, not only the standard ones.
  *
  * @author Piotr S. Staszewski
  */
@@ -9,59 +12,48 @@
 #include <stdbool.h>
 #include <stdlib.h>
 
+#include <asm/termbits.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
-#include <termios.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include "common.h"
 #include "serial.h"
 
-// Public variables
-
-SerialConfig serConfig;
-
 // Public routines
 
 /** Parse serial port mode string.
- * The format its 'speedXparityXbitSizeXstopBits' where X is either
+ * The format its 'speedXparityXbitSizeXstopBits[Xfast]' where X is either
  * a ':' or ',' (a separator). Currently code only for most common values.
+ * The optional fast is the speed to switch the panel to once connected.
  * Will either fully succeed or die.
  *
  * @param str Pointer to string containing serial mode
+ * @param cfg Where to put the config
  */
-void serial_parse(char *str) {
+void serial_parse(char *str, SerialConfig *cfg) {
   char *token = NULL;
   int position, temp;
 
   position = temp = 0;
-  bzero(&serConfig, sizeof(serConfig));
+  bzero(cfg, sizeof(*cfg));
 
   token = strtok(str, SER_SEPARATORS); 
   while (token != NULL) {
     switch (position) {
       case 0: // speed
-        temp = atoi(token);
-        switch (temp) {
-          case 115200:  serConfig.speed = B115200; break;
-          case 57600:   serConfig.speed = B57600;  break;
-          case 38400:   serConfig.speed = B38400;  break;
-          case 19200:   serConfig.speed = B19200;  break;
-          case 9600:    serConfig.speed = B9600;   break;
-          case 4800:    serConfig.speed = B4800;   break;
-          case 2400:    serConfig.speed = B2400;   break;
-          case 1200:    serConfig.speed = B1200;   break;
-          default:
-            die("Unrecognised serial speed");
-            break;
-        }
+        if ((cfg->speed = atoi(token)) < SER_MINSPEED)
+          die("Unrecognised serial speed");
         break;
 
       case 1: // parity
         switch (token[0]) {
-          case 'n': serConfig.parity = 0;                  break;
-          case 'e': serConfig.parity = PARENB;             break; 
-          case 'o': serConfig.parity = (PARENB | PARODD);  break;
+          case 'n': cfg->parity = 0;                  break;
+          case 'e': cfg->parity = PARENB;             break; 
+          case 'o': cfg->parity = (PARENB | PARODD);  break;
           default:
             die("Unrecognised serial parity");
             break;
@@ -71,10 +63,10 @@ void serial_parse(char *str) {
       case 2: // bitsize
         temp = atoi(token);
         switch (temp) {
-          case 5: serConfig.bitSize = CS5; break;
-          case 6: serConfig.bitSize = CS6; break;
-          case 7: serConfig.bitSize = CS7; break;
-          case 8: serConfig.bitSize = CS8; break;
+          case 5: cfg->bitSize = CS5; break;
+          case 6: cfg->bitSize = CS6; break;
+          case 7: cfg->bitSize = CS7; break;
+          case 8: cfg->bitSize = CS8; break;
           default:
             die("Unrecognised serial bit size");
             break;
@@ -84,49 +76,99 @@ void serial_parse(char *str) {
       case 3: // stopbits
         temp = atoi(token);
         switch (temp) {
-          case 1: serConfig.stopBits = 0;      break;
-          case 2: serConfig.stopBits = CSTOPB; break;
+          case 1: cfg->stopBits = 0;      break;
+          case 2: cfg->stopBits = CSTOPB; break;
           default:
             die("Unrecognised serial stop bits");
             break;
         }
+        break;
+
+      case 4: // fast
+        if ((cfg->fast = atoi(token)) <= cfg->speed)
+          die("Fast serial speed has to be above the speed");
+        break;
     }
     token = strtok(NULL, SER_SEPARATORS); 
     position++;
   }
 
-  if (position != 4)
-    die("Please use '9600,n,8,1' format for serial port setup");
+  if ((position != 4) && (position != 5))
+    die("Please use '9600,n,8,1' or '9600,n,8,1,250000' format for serial port setup");
 }
 
-/** Setup serial port according to serConfig.
+/** Setup serial port according to cfg.
  * Serial port will be setup as non-blocking.
- * Will either fully succeed or die.
  *
- * @param fd Opened fd of the serial port device
+ * @param fd  Opened fd of the serial port device
+ * @param cfg The config
+ * @return False on failure, errno tells why
  */
-void serial_setup(int fd) {
-  struct termios tty;
+bool serial_setup(int fd, const SerialConfig *cfg) {
+  struct termios2 tty;
 
   bzero(&tty, sizeof(tty));
-  if (tcgetattr(fd, &tty) != 0)
-    die("Can't get serial port current serConfig");
-
-  cfsetispeed(&tty, serConfig.speed);
-  cfsetospeed(&tty, serConfig.speed);
+  if (ioctl(fd, TCGETS2, &tty) != 0)
+    return false;
 
   tty.c_iflag &= ~(IXON | IXOFF | IXANY);
   tty.c_oflag = 0;
   tty.c_lflag = 0;
 
-  tty.c_cflag = (tty.c_cflag & ~CSIZE) | serConfig.bitSize;
+  tty.c_cflag = (tty.c_cflag & ~CSIZE) | cfg->bitSize;
   tty.c_cflag &= ~(CRTSCTS | CSTOPB | PARENB | PARODD);
-  tty.c_cflag |= (serConfig.parity | serConfig.stopBits);
+  tty.c_cflag |= (cfg->parity | cfg->stopBits);
   tty.c_cflag |= CLOCAL | CREAD;
 
+  tty.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tty.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tty.c_ispeed = tty.c_ospeed = cfg->speed;
+
   tty.c_cc[VMIN] = 0;
   tty.c_cc[VTIME] = SER_TIMEOUT;
 
-  if (tcsetattr(fd, TCSANOW, &tty) != 0)
-    die("Can't setup serial port");
+  return ioctl(fd, TCSETS2, &tty) == 0;
+}
+
+/** Change the baud rate of a set up serial port
+ * Output still pending is sent at the old rate first.
+ *
+ * @param fd    Opened fd of the serial port device
+ * @param speed The baud rate
+ * @return False on failure, errno tells why
+ */
+bool serial_speed(int fd, int speed) {
+  struct termios2 tty;
+
+  if (ioctl(fd, TCGETS2, &tty) != 0)
+    return false;
+
+  tty.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+  tty.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tty.c_ispeed = tty.c_ospeed = speed;
+
+  return ioctl(fd, TCSETSW2, &tty) == 0;
+}
+
+/** Open, lock and setup serial port device
+ * The lock does not wait, a device in use by someone else is a failure.
+ *
+ * @param device Path to the device
+ * @param cfg    The config
+ * @return Opened fd, -1 on failure (errno tells why)
+ */
+int serial_open(const char *device, const SerialConfig *cfg) {
+  int fd, err;
+
+  if ((fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0)
+    return -1;
+
+  if ((flock(fd, LOCK_EX | LOCK_NB) != 0) || !serial_setup(fd, cfg)) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
 }
@@ -7,25 +7,29 @@
 #ifndef IRPD_SERIAL
 #define IRPD_SERIAL 1
 
+#include <stdbool.h>
+
 // Configurable defines
 
 #define SER_SEPARATORS  ":,"  //!< Separators for serial config string
 #define SER_TIMEOUT     5     //!< Serial port read timeout in tenths of a second
+#define SER_MINSPEED    50    //!< Slowest baud rate taken
 
 // Public types and variables
 
 typedef struct {
-  int speed;
+  int speed;                  //!< Baud rate to open at
+  int fast;                   //!< Baud rate to switch the panel to, 0 to stay
   int parity;
   int bitSize;
   int stopBits;
 } SerialConfig;
 
-extern SerialConfig serConfig;  //!< Global serial port config
-
 // Public routines
 
-void serial_parse(char *str);
-void serial_setup(int fd);
+void serial_parse(char *str, SerialConfig *cfg);
+bool serial_setup(int fd, const SerialConfig *cfg);
+bool serial_speed(int fd, int speed);
+int serial_open(const char *device, const SerialConfig *cfg);
 
 #endif
@@ -0,0 +1,80 @@
+/** @file
+ * Single-producer single-consumer queue library
+ *
+ * A lock-free ring of fixed-size entries between exactly two threads:
+ * one only ever pushes, the other only ever pops. Each side owns one
+ * index and only reads the other's, so neither ever waits on a lock. The
+ * indices live on separate cache lines, so the two sides do not keep
+ * stealing each other's line.
+ *
+ * The indices are sequentially consistent, so a side that publishes an
+ * entry (or takes one) and then checks a wakeup flag can not miss the
+ * other side doing the same in the opposite order (see relay.c).
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+
+#include <string.h>
+
+#include "spsc.h"
+
+// Public routines
+
+/** Empty a queue
+ * Only while neither thread uses it.
+ *
+ * @param q The queue
+ */
+void spsc_init(Spsc *q) {
+  q->head = q->tail = 0;
+}
+
+/** Add an entry
+ * Producer side only.
+ *
+ * @param q    The queue
+ * @param data The entry
+ * @param len  Its length (at most SPSC_SLOT)
+ * @return False if the queue is full
+ */
+bool spsc_push(Spsc *q, const void *data, int len) {
+  unsigned tail = q->tail;
+
+  if (tail - __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) >= SPSC_SLOTS)
+    return false;
+
+  memcpy(q->slot[tail % SPSC_SLOTS], data, len);
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+/** Take the oldest entry
+ * Consumer side only.
+ *
+ * @param q    The queue
+ * @param data Where to put it (SPSC_SLOT bytes)
+ * @return False if the queue is empty
+ */
+bool spsc_pop(Spsc *q, void *data) {
+  unsigned head = q->head;
+
+  if (head == __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST))
+    return false;
+
+  memcpy(data, q->slot[head % SPSC_SLOTS], SPSC_SLOT);
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+  return true;
+}
+
+/** Check whether a queue is empty
+ * Either side, the answer may be stale for the other one.
+ *
+ * @param q The queue
+ * @return True if so
+ */
+bool spsc_empty(Spsc *q) {
+  return __atomic_load_n(&q->head, __ATOMIC_SEQ_CST) ==
+    __atomic_load_n(&q->tail, __ATOMIC_SEQ_CST);
+}
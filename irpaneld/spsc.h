@@ -0,0 +1,30 @@
+/** @file
+ * Single-producer single-consumer queue library configuration
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_SPSC
+#define IRPD_SPSC 1
+
+// Configurable defines
+
+#define SPSC_SLOTS    256   //!< Entries per queue (a power of two)
+#define SPSC_SLOT     32    //!< Bytes per entry
+
+// Public types
+
+typedef struct {
+  unsigned head __attribute__((aligned(64))); //!< Next entry to take, written by the consumer
+  unsigned tail __attribute__((aligned(64))); //!< Next entry to fill, written by the producer
+  unsigned char slot[SPSC_SLOTS][SPSC_SLOT] __attribute__((aligned(64))); //!< The entries
+} Spsc;
+
+// Public routines
+
+void spsc_init(Spsc *q);
+bool spsc_push(Spsc *q, const void *data, int len);
+bool spsc_pop(Spsc *q, void *data);
+bool spsc_empty(Spsc *q);
+
+#endif
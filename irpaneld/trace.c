@@ -0,0 +1,119 @@
+/** @file
+ * Flight recorder library
+ *
+ * Keeps the last TRC_RECORDS events (panel packets, acks and timeouts,
+ * client commands, poll wakeups) as fixed-size binary records in a ring.
+ * Recording one is a clock read and a short copy, so it stays on in
+ * production builds. The ring is written out on demand (SIGUSR2) or, at
+ * most once per TRC_HOLDOFF, after a panel error, so stalls can be looked
+ * into afterwards with tools/irtrace.
+ *
+ * Records may be added from any thread: each one claims its slot
+ * atomically. A dump taken while another thread records may catch a
+ * record half written.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <string.h>
+
+#include "common.h"
+#include "hist.h"
+#include "trace.h"
+
+// Internal variables
+
+static TraceRecord ring[TRC_RECORDS]; //!< The records
+static unsigned long added;           //!< Records ever added
+static bool triggered;                //!< An error asked for a dump
+static long lastDump;                 //!< When the last triggered dump was (us), 0 if never
+
+// Public routines
+
+/** Record an event
+ *
+ * @param type The event type
+ * @param who  Client slot (or panel index), TRC_NOBODY if none
+ * @param data Event data (only the first TRC_DATA bytes are kept)
+ * @param len  Length of data
+ */
+void trace_add(TraceType type, int who, const void *data, int len) {
+  TraceRecord *r = &ring[__atomic_fetch_add(&added, 1, __ATOMIC_RELAXED) % TRC_RECORDS];
+
+  r->at = hist_now();
+  r->type = type;
+  r->who = who;
+  r->len = len > 0xff ? 0xff : len;
+  if (len > TRC_DATA) len = TRC_DATA;
+  if (len > 0) memcpy(r->data, data, len);
+}
+
+/** Ask for a dump because something went wrong
+ * The dump itself is left to the main loop, see trace_due().
+ */
+void trace_trigger() {
+  __atomic_store_n(&triggered, true, __ATOMIC_RELAXED);
+}
+
+/** Check whether a triggered dump should be written now
+ * Errors tend to come in bursts, so only one dump per TRC_HOLDOFF is due.
+ *
+ * @return True if so
+ */
+bool trace_due() {
+  long now;
+
+  if (!__atomic_exchange_n(&triggered, false, __ATOMIC_RELAXED)) return false;
+
+  now = hist_now();
+  if ((lastDump > 0) && (now - lastDump < TRC_HOLDOFF * 1000000L))
+    return false;
+  lastDump = now;
+  return true;
+}
+
+/** Write the records to a file, oldest first
+ *
+ * @param path Where to write them (replaced)
+ * @return True if written
+ */
+bool trace_dump(const char *path) {
+  TraceHeader hdr;
+  unsigned long first, total;
+  FILE *f;
+  int n;
+
+  if ((f = fopen(path, "w")) == NULL) {
+    warn("Can't open trace file");
+    return false;
+  }
+
+  total = __atomic_load_n(&added, __ATOMIC_RELAXED);
+  n = total < TRC_RECORDS ? total : TRC_RECORDS;
+  first = total - n;
+
+  memcpy(hdr.magic, TRC_MAGIC, sizeof(hdr.magic));
+  hdr.size = sizeof(TraceRecord);
+  hdr.count = n;
+  hdr.now = hist_now();
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  // the ring in at most two pieces
+  if (first % TRC_RECORDS + n <= TRC_RECORDS)
+    fwrite(&ring[first % TRC_RECORDS], sizeof(TraceRecord), n, f);
+  else {
+    fwrite(&ring[first % TRC_RECORDS], sizeof(TraceRecord), TRC_RECORDS - first % TRC_RECORDS, f);
+    fwrite(&ring[0], sizeof(TraceRecord), (first + n) % TRC_RECORDS, f);
+  }
+
+  if (fclose(f) != 0) {
+    warn("Can't write trace file");
+    return false;
+  }
+
+  note("Trace of %d records written to: %s", n, path);
+  return true;
+}
@@ -0,0 +1,70 @@
+/** @file
+ * Flight recorder library configuration
+ *
+ * Also describes the dump file format, for tools/irtrace.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#ifndef IRPD_TRACE
+#define IRPD_TRACE 1
+
+#include <stdint.h>
+
+// Configurable defines
+
+#define TRC_RECORDS   8192  //!< Records kept (the oldest are overwritten)
+#define TRC_HOLDOFF   10    //!< Seconds between dumps triggered by errors
+
+// Public defines
+
+#define TRC_MAGIC     "IRPTRC1\n" //!< Dump file magic (8 bytes)
+#define TRC_DATA      13          //!< Payload bytes kept per record
+#define TRC_NOBODY    0xff        //!< Record not tied to a client
+
+// Public types
+
+typedef enum {
+  TRC_WAKE,                   //!< Poll wakeup, data: events (1 byte)
+  TRC_PANEL_OUT,              //!< Packet queued for the panel
+  TRC_PANEL_IN,               //!< Packet decoded from the panel
+  TRC_TIMEOUT,                //!< Command never acked
+  TRC_GARBAGE,                //!< Bytes skipped, data: count (4 bytes)
+  TRC_PARTIAL,                //!< Partial frame given up on
+  TRC_WRITE_FAIL,             //!< Write to the panel failed
+  TRC_CONNECT,                //!< Client connected
+  TRC_DISCONNECT,             //!< Client disconnected
+  TRC_COMMAND,                //!< Client command, data: the line or frame
+  TRC_FLUSH,                  //!< Changes sent, data: bytes planned (4 bytes)
+  TRC_REOPEN,                 //!< Panel gone, reopening it
+  TRC_BACK,                   //!< Panel back, data: window (1 byte)
+  TRC_TYPES                   //!< Number of record types
+} TraceType;
+
+#define TRC_NAMES { "wake", "panel>", "panel<", "timeout", "garbage", \
+  "partial", "wfail", "connect", "discon", "command", "flush", \
+  "reopen", "back" } //!< By type
+
+typedef struct {
+  int64_t at;                 //!< Monotonic time in us
+  uint8_t type;               //!< TraceType
+  uint8_t who;                //!< Client slot (panel index for panel, flush and reopen records), TRC_NOBODY if none
+  uint8_t len;                //!< Length of the original data
+  uint8_t data[TRC_DATA];     //!< Its first TRC_DATA bytes
+} TraceRecord;
+
+typedef struct {
+  char magic[8];              //!< TRC_MAGIC
+  uint32_t size;              //!< sizeof(TraceRecord)
+  uint32_t count;             //!< Records that follow, oldest first
+  int64_t now;                //!< Monotonic time of the dump in us
+} TraceHeader;
+
+// Public routines
+
+void trace_add(TraceType type, int who, const void *data, int len);
+void trace_trigger(void);
+bool trace_due(void);
+bool trace_dump(const char *path);
+
+#endif
@@ -0,0 +1,471 @@
+/** @file
+ * irpaneld load generator and latency benchmark
+ *
+ * Opens a number of clients, each driving the same workload in a closed
+ * loop (next operation once the previous one was answered), and reports
+ * the throughput and the latency distribution of the operations. Works
+ * the same against a real panel and the host emulator.
+ *
+ * Workloads:
+ *  - repaint: all four lines rewritten, as one batch
+ *  - field: a five character counter, each client in a window of its own
+ *  - dim: a backlight ramp
+ *  - window: a batch resizing the window and drawing in its far corner,
+ *    followed by one shrinking it and drawing outside, which has to be
+ *    refused (so batches are checked against their own window)
+ *  - ir: key presses played into the emulator, timed until every client
+ *    has been told
+ *
+ * With end-to-end timing every operation also waits for a sync, so the
+ * latency covers the panel actually showing the change.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+
+#ifndef UNIX_PATH_MAX
+  #define UNIX_PATH_MAX sizeof(sun.sun_path)
+#endif
+
+// Configurable defines
+
+#define DEF_CLIENTS 1       //!< Default number of clients
+#define DEF_OPS     1000    //!< Default operations per client
+#define DEF_FRAMES  2       //!< Default RC5 frames per press (the daemon squash)
+#define MAX_CLIENTS 16      //!< Most clients (the daemon limit)
+#define IR_TIMEOUT  2       //!< Seconds to wait for an IR event
+
+// Internal types and variables
+
+typedef enum {
+  LOAD_REPAINT,
+  LOAD_FIELD,
+  LOAD_DIM,
+  LOAD_WINDOW,
+  LOAD_IR
+} Workload;
+
+static const char *loadName[] = {"repaint", "field", "dim", "window", "ir"};
+static const int loadCmds[] = {8, 2, 1, 5, 0}; //!< Commands per operation
+#define LOADS (int)(sizeof(loadName) / sizeof(*loadName)) //!< Number of workloads
+
+typedef struct {
+  int id;                   //!< Client number
+  int fd;                   //!< Daemon socket
+  FILE *in;                 //!< For reading replies
+  long *lat;                //!< Operation latencies in us
+  int done;                 //!< Operations done
+  int failed;               //!< Operations answered with an error (or lost)
+} Client;
+
+static struct sockaddr_in sin;
+static struct sockaddr_un sun;
+static struct sockaddr *addr;
+static socklen_t slen;
+
+static Workload load;
+static int numClients, numOps, frames;
+static bool endToEnd;
+static char *fifo;
+
+static Client clients[MAX_CLIENTS];
+static pthread_barrier_t barrier;   //!< Lines up the clients for each press
+static long pressedAt;              //!< When the current press was played
+
+// Internal routines
+
+/** Monotonic time in microseconds
+ *
+ * @return The time
+ */
+long now_us() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+/** Connect to the daemon
+ *
+ * @return The socket
+ */
+int connect_daemon() {
+  int fd;
+
+  if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0)
+    die("Can't create a socket");
+  if (connect(fd, addr, slen) != 0)
+    die("Can't connect");
+
+  return fd;
+}
+
+/** Send a string to the daemon
+ *
+ * @param c   The client
+ * @param str The string
+ */
+void send_str(Client *c, const char *str) {
+  int len = strlen(str);
+
+  if (write(c->fd, str, len) != len)
+    die("Can't write to daemon");
+}
+
+/** Read replies from the daemon
+ * IR events (from presses still coming in) are not replies, and skipped.
+ *
+ * @param c     The client
+ * @param count Number of replies
+ * @return False if any was not 'ok'
+ */
+bool read_replies(Client *c, int count) {
+  char line[4096];
+  bool ok = true;
+
+  for (; count > 0; count--) {
+    if (fgets(line, sizeof(line), c->in) == NULL)
+      die("Daemon went away");
+    if ((strncmp(line, "ir:", 3) == 0) || (strncmp(line, "key:", 4) == 0)) {
+      count++;
+      continue;
+    }
+    if (strncmp(line, "ok", 2) != 0) {
+      dbg(fprintf(stderr, "Client %d: %s", c->id, line));
+      ok = false;
+    }
+  }
+
+  return ok;
+}
+
+/** Wait for an IR event
+ * Events for other keys (left over from lost presses) are skipped.
+ *
+ * @param c   The client
+ * @param cmd RC5 command to wait for
+ * @return False on timeout
+ */
+bool read_ir(Client *c, int cmd) {
+  char line[256];
+  int a, b;
+
+  while (fgets(line, sizeof(line), c->in) != NULL)
+    if ((sscanf(line, "ir:%d:%d", &a, &b) == 2) && (b == cmd))
+      return true;
+
+  clearerr(c->in);
+  return false;
+}
+
+/** Play a key press into the emulator
+ *
+ * @param cmd RC5 command
+ */
+void press(int cmd) {
+  FILE *f;
+
+  if ((f = fopen(fifo, "w")) == NULL)
+    die("Can't open RC5 FIFO");
+  fprintf(f, "0 %d %d\n", cmd, frames);
+  fclose(f);
+}
+
+/** Client thread
+ *
+ * @param arg The client
+ * @return NULL
+ */
+void *client_run(void *arg) {
+  Client *c = arg;
+  struct timeval tv;
+  char buf[256], *pos;
+  long start;
+  int i, y, replies, w, h, cols = 0, lines = 0;
+  bool ok;
+
+  if (load == LOAD_FIELD) {
+    snprintf(buf, sizeof(buf), "w:%d:%d:5:1\n", (c->id % 4) * 5, (c->id / 4) % 4);
+    send_str(c, buf);
+    read_replies(c, 1);
+  } else if (load == LOAD_IR) {
+    tv.tv_sec = IR_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  } else if (load == LOAD_WINDOW) { // 'ok:NAME:COLS:LINES'
+    send_str(c, "q:a\n");
+    if ((fgets(buf, sizeof(buf), c->in) == NULL) || ((pos = strrchr(buf, ':')) == NULL))
+      die("Can't query the panel size");
+    lines = atoi(pos + 1);
+    for (pos--; (pos > buf) && (*pos != ':'); pos--);
+    cols = atoi(pos + 1);
+    if ((cols < 2) || (lines < 1))
+      die("Panel too small");
+  }
+
+  for (i = 0; i < numOps; i++) {
+    replies = 1;
+
+    switch (load) {
+      case LOAD_REPAINT:
+        snprintf(buf, sizeof(buf), "b:8\n");
+        for (y = 0; y < 4; y++)
+          snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+              "g:0:%d\np:%02d:%07d line %d..\n", y, c->id, i, y);
+        break;
+
+      case LOAD_FIELD:
+        snprintf(buf, sizeof(buf), "b:2\ng:0:0\np:%05d\n", i % 100000);
+        break;
+
+      case LOAD_DIM:
+        snprintf(buf, sizeof(buf), "d:%d\n", (i / 256) % 2 ? 255 - i % 256 : i % 256);
+        break;
+
+      case LOAD_WINDOW:
+        w = (i % 2) ? cols : 1 + i % cols;
+        h = (i % 2) ? lines : 1 + (i / 2) % lines;
+        snprintf(buf, sizeof(buf), "b:3\nw:0:0:%d:%d\ng:%d:%d\np:*\n"
+            "b:2\nw:0:0:1:1\ng:1:0\n", w, h, w - 1, h - 1);
+        replies = 2;
+        break;
+
+      case LOAD_IR:
+        pthread_barrier_wait(&barrier);
+        if (c->id == 0) {
+          pressedAt = now_us();
+          press(i % 64);
+        }
+        ok = read_ir(c, i % 64);
+        c->lat[c->done++] = now_us() - pressedAt;
+        if (!ok) c->failed++;
+        continue;
+    }
+
+    if (endToEnd) {
+      strcat(buf, "y\n");
+      replies++;
+    }
+
+    start = now_us();
+    send_str(c, buf);
+    if (load == LOAD_WINDOW) // the second batch has to be refused
+      ok = read_replies(c, 1) & !read_replies(c, 1) & read_replies(c, replies - 2);
+    else
+      ok = read_replies(c, replies);
+    if (!ok) c->failed++;
+    c->lat[c->done++] = now_us() - start;
+  }
+
+  return NULL;
+}
+
+/** Compare latencies for qsort
+ *
+ * @param a First latency
+ * @param b Second latency
+ * @return Order
+ */
+int cmp_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+
+  return (x > y) - (x < y);
+}
+
+/** Latency at a quantile
+ *
+ * @param lat      Sorted latencies
+ * @param count    Number of latencies
+ * @param permille The quantile, in 1/1000
+ * @return The latency
+ */
+long quantile(const long *lat, int count, int permille) {
+  long i = ((long)count * permille + 999) / 1000 - 1;
+
+  if (i < 0) i = 0;
+  if (i >= count) i = count - 1;
+  return lat[i];
+}
+
+/** Query the daemon statistics
+ * Not an error if the daemon does not have them.
+ *
+ * @param line Where to put them
+ * @param size Its size
+ * @return The I/O system calls the daemon made so far, -1 if not known
+ */
+long query_stats(char *line, int size) {
+  Client c;
+  char *pos;
+
+  c.fd = connect_daemon();
+  if ((c.in = fdopen(c.fd, "r")) == NULL)
+    die("Can't open daemon socket");
+
+  send_str(&c, "q:s\n");
+  if ((fgets(line, size, c.in) == NULL) || (strncmp(line, "ok:", 3) != 0))
+    line[0] = 0;
+  fclose(c.in);
+
+  if ((pos = strstr(line, "syscalls=")) == NULL) return -1;
+  return atol(pos + 9);
+}
+
+void usage(char *name) {
+  fprintf(stderr, "  Usage: %s [options...] (-t HOST:PORT|-u PATH)\n", name);
+  fprintf(stderr, "\nOptions:\n");
+  fprintf(stderr, "\t-c NUM       - number of clients (default: "STR(DEF_CLIENTS)")\n");
+  fprintf(stderr, "\t-n NUM       - operations per client (default: "STR(DEF_OPS)")\n");
+  fprintf(stderr, "\t-w LOAD      - repaint, field, dim, window or ir (default: field)\n");
+  fprintf(stderr, "\t-e           - end-to-end, wait for the panel after each operation\n");
+  fprintf(stderr, "\t-i FIFO      - RC5 FIFO of the emulator (ir workload)\n");
+  fprintf(stderr, "\t-f NUM       - RC5 frames per press (default: "STR(DEF_FRAMES)")\n");
+  fprintf(stderr, "\nAnd one of the following:\n");
+  fprintf(stderr, "\t-t HOST:PORT - connect to a TCP socket on HOST:PORT\n");
+  fprintf(stderr, "\t-u PATH      - connect to a UNIX domain socket at PATH\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t threads[MAX_CLIENTS];
+  struct hostent *he;
+  long *all, start, took, calls, after;
+  char stats[4096];
+  int opt, num, i, j, total, failed;
+
+  if (argc < 3) usage(argv[0]);
+
+  addr = NULL;
+  fifo = NULL;
+  numClients = DEF_CLIENTS;
+  numOps = DEF_OPS;
+  frames = DEF_FRAMES;
+  load = LOAD_FIELD;
+  endToEnd = false;
+
+  while ((opt = getopt(argc, argv, "c:n:w:ei:f:t:u:")) != -1)
+    switch (opt) {
+      case 'c': numClients = atoi(optarg); break;
+      case 'n': numOps = atoi(optarg);     break;
+      case 'e': endToEnd = true;           break;
+      case 'i': fifo = optarg;             break;
+      case 'f': frames = atoi(optarg);     break;
+
+      case 'w':
+        for (num = 0; num < LOADS; num++)
+          if (strcmp(optarg, loadName[num]) == 0) break;
+        if (num == LOADS) usage(argv[0]);
+        load = num;
+        break;
+
+      case 't':
+        if (addr != NULL) usage(argv[0]);
+
+        bzero(&sin, sizeof(sin));
+        sin.sin_family = AF_INET;
+
+        if ((he = gethostbyname(strtok(optarg, ":"))) == NULL)
+          die("Can't find IP for the supplied HOST");
+        memcpy(&sin.sin_addr, he->h_addr_list[0], sizeof(sin.sin_addr));
+
+        num = atoi(strtok(NULL, ":"));
+        if ((num < 1) || (num > 65535))
+          die("Invalid PORT number");
+        sin.sin_port = htons(num);
+
+        addr = (struct sockaddr *)&sin;
+        slen = sizeof(sin);
+        break;
+
+      case 'u':
+        if (addr != NULL) usage(argv[0]);
+
+        bzero(&sun, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+
+        num = strlen(optarg);
+        if ((num < 1) || (num >= UNIX_PATH_MAX))
+          die("Unix socket path to short/long");
+        strncpy((char *)&sun.sun_path, optarg, UNIX_PATH_MAX - 1);
+
+        addr = (struct sockaddr *)&sun;
+        slen = sizeof(sun);
+        break;
+
+      default:
+        usage(argv[0]);
+        break;
+    }
+
+  if (addr == NULL) usage(argv[0]);
+  if ((numClients < 1) || (numClients > MAX_CLIENTS))
+    die("Invalid number of clients");
+  if (numOps < 1)
+    die("Invalid number of operations");
+  if ((load == LOAD_IR) && (fifo == NULL))
+    die("The ir workload needs the emulator RC5 FIFO");
+
+  pthread_barrier_init(&barrier, NULL, numClients);
+
+  for (i = 0; i < numClients; i++) {
+    clients[i].id = i;
+    clients[i].fd = connect_daemon();
+    if ((clients[i].in = fdopen(clients[i].fd, "r")) == NULL)
+      die("Can't open daemon socket");
+    if ((clients[i].lat = malloc(numOps * sizeof(long))) == NULL)
+      die("Can't allocate latencies");
+    clients[i].done = clients[i].failed = 0;
+  }
+
+  calls = query_stats(stats, sizeof(stats));
+  start = now_us();
+  for (i = 0; i < numClients; i++)
+    if (pthread_create(&threads[i], NULL, client_run, &clients[i]) != 0)
+      die("Can't start client thread");
+  for (i = 0; i < numClients; i++)
+    pthread_join(threads[i], NULL);
+  took = now_us() - start;
+
+  if ((all = malloc(numClients * numOps * sizeof(long))) == NULL)
+    die("Can't allocate latencies");
+  for (i = total = failed = 0; i < numClients; i++) {
+    for (j = 0; j < clients[i].done; j++)
+      all[total++] = clients[i].lat[j];
+    failed += clients[i].failed;
+    fclose(clients[i].in);
+    free(clients[i].lat);
+  }
+  qsort(all, total, sizeof(long), cmp_long);
+
+  printf("workload: %s, %d clients, %d ops each%s\n", loadName[load],
+      numClients, numOps, endToEnd ? ", end-to-end" : "");
+  printf("ops: %d in %.3f s, %.1f ops/s, %.1f cmds/s, %d failed\n", total,
+      took / 1e6, total / (took / 1e6), total * loadCmds[load] / (took / 1e6), failed);
+  printf("latency (us): min %ld, p50 %ld, p99 %ld, p999 %ld, max %ld\n",
+      all[0], quantile(all, total, 500), quantile(all, total, 990),
+      quantile(all, total, 999), all[total-1]);
+
+  after = query_stats(stats, sizeof(stats));
+  if (stats[0] != 0)
+    printf("daemon: %s", stats + 3);
+  if ((calls >= 0) && (after >= 0))
+    printf("daemon syscalls: %ld, %.2f per op\n", after - calls, (double)(after - calls) / total);
+
+  free(all);
+  return 0;
+}
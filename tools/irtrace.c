@@ -0,0 +1,126 @@
+/** @file
+ * irpaneld flight recorder dump reader
+ *
+ * Prints the records of a trace dump (see irpaneld/trace.c) one per line,
+ * oldest first: seconds before the dump, milliseconds since the previous
+ * record, the event, the client slot and the recorded data. Panel packets
+ * and binary frames are shown in hex, ASCII commands as text.
+ *
+ * @author Piotr S. Staszewski
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ctype.h>
+#include <string.h>
+
+#include "common.h"
+#include "../irpaneld/trace.h"
+
+// Internal variables
+
+static const char *typeName[TRC_TYPES] = TRC_NAMES;
+
+// Internal routines
+
+/** Print usage.
+ * @param name Name of the command
+ */
+void usage(char *name) {
+  fprintf(stderr, "  Usage: %s TRACE\n", name);
+  exit(1);
+}
+
+/** Check whether recorded data reads as text
+ *
+ * @param r The record
+ * @return True if every kept byte is printable
+ */
+bool printable(const TraceRecord *r) {
+  int i, n;
+
+  n = r->len < TRC_DATA ? r->len : TRC_DATA;
+  for (i = 0; i < n; i++)
+    if (!isprint(r->data[i])) return false;
+  return n > 0;
+}
+
+/** Print the data of a record
+ *
+ * @param r The record
+ */
+void print_data(const TraceRecord *r) {
+  int32_t value;
+  int i, n;
+
+  n = r->len < TRC_DATA ? r->len : TRC_DATA;
+  switch (r->type) {
+    case TRC_WAKE:
+      printf("%u events", r->data[0]);
+      return;
+
+    case TRC_GARBAGE:
+    case TRC_FLUSH:
+      memcpy(&value, r->data, sizeof(value));
+      printf("%d bytes", value);
+      return;
+
+    case TRC_BACK:
+      printf("window %u", r->data[0]);
+      return;
+
+    case TRC_COMMAND:
+      if (printable(r)) {
+        printf("\"%.*s\"%s", n, r->data, r->len > n ? "..." : "");
+        return;
+      }
+      break;
+  }
+
+  for (i = 0; i < n; i++)
+    printf("%02x ", r->data[i]);
+  if (r->len > n) printf("...");
+}
+
+// Main routine
+
+int main(int argc, char *argv[]) {
+  TraceHeader hdr;
+  TraceRecord r;
+  int64_t last;
+  uint32_t i;
+  FILE *f;
+
+  if (argc != 2) usage(argv[0]);
+
+  if ((f = fopen(argv[1], "r")) == NULL)
+    die("Can't open trace file");
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+    die("Can't read trace header");
+  if (memcmp(hdr.magic, TRC_MAGIC, sizeof(hdr.magic)) != 0)
+    die("Not a trace file");
+  if (hdr.size != sizeof(TraceRecord))
+    die("Trace from an incompatible irpaneld");
+
+  last = -1;
+  for (i = 0; i < hdr.count; i++) {
+    if (fread(&r, sizeof(r), 1, f) != 1)
+      die("Trace file truncated");
+    if (r.type >= TRC_TYPES) continue;
+
+    printf("%11.6f %+9.3f  %-8s ", (r.at - hdr.now) / 1e6,
+        last < 0 ? 0.0 : (r.at - last) / 1e3, typeName[r.type]);
+    if (r.who == TRC_NOBODY) printf("  -  ");
+    else printf("%3u  ", r.who);
+    print_data(&r);
+    printf("\n");
+
+    last = r.at;
+  }
+
+  fclose(f);
+  exit(0);
+}
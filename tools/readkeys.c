@@ -111,9 +111,9 @@ int main(int argc, char *argv[]) {
         sun.sun_family = AF_UNIX;
 
         num = strlen(optarg);
-        if ((num < 1) || (num > UNIX_PATH_MAX))
+        if ((num < 1) || (num >= UNIX_PATH_MAX))
           die("Unix socket path to short/long");
-        strncpy((char *)&sun.sun_path, optarg, UNIX_PATH_MAX);
+        strncpy((char *)&sun.sun_path, optarg, UNIX_PATH_MAX - 1);
 
         if ((fdServer = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
           die("Can't create a UNIX socket");